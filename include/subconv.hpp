@@ -1,7 +1,17 @@
 #ifndef SUBCONV_H
 #define   SUBCONV_H
 
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
 #include <list>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
 #include <vector>
 #include <memory>
 #include <unordered_map>
@@ -15,7 +25,8 @@ namespace subconv {
 
 struct Directives {
   Directives() : dsrqst_root(), dataset_block(), pbs_options(), host_restrict(),
-      obj_store(), data_root(), db_config() { }
+      obj_store(), data_root(), db_config(), memory_limit(0),
+      file_retries(2), inventory_cache() { }
 
   std::string dsrqst_root, dataset_block, pbs_options;
   std::vector<std::string> host_restrict;
@@ -29,21 +40,31 @@ struct Directives {
   } obj_store;
   std::string data_root;
   PostgreSQL::DBconfig db_config;
+  long long memory_limit;
+  size_t file_retries;
+  std::string inventory_cache;
 };
 
 struct Args {
   Args() : SHARE_DIRECTORY(
       "/lustre/desc1/gdex/work/gdexdata/share"), num_threads(0),
       rinfo(), rqst_index(), download_directory(), batch_type(0x0),
-      main_timer(), db_timer(), is_test(false), ignore_volume(false),
-      ignore_restrictions(false), get_timings(false) { }
+      main_timer(), db_timer(), shard_index(0), num_shards(0), is_test(false),
+      ignore_volume(false), ignore_restrictions(false), get_timings(false),
+      merge_shards(false), is_array_task(false) { }
 
   const std::string SHARE_DIRECTORY;
   size_t num_threads;
   std::string rinfo, rqst_index, download_directory;
   char batch_type;
   Timer main_timer, db_timer;
-  bool is_test, ignore_volume, ignore_restrictions, get_timings;
+
+  // num_shards is zero unless the request is split across multiple jobs; a
+  //   shard that is a task of a batch job array gets its shard from the
+  //   array index
+  size_t shard_index, num_shards;
+  bool is_test, ignore_volume, ignore_restrictions, get_timings, merge_shards,
+      is_array_task;
 };
 
 struct RequestValues {
@@ -72,11 +93,33 @@ struct RequestValues {
   } ancillary;
 };
 
+// LatencyHistogram counts latencies in logarithmic buckets, four per doubling
+//   starting at one microsecond; histograms from different threads merge
+//   exactly, and a percentile is reported as the upper edge of its bucket
+//   (within 19% of the true value)
+class LatencyHistogram
+{
+public:
+  LatencyHistogram() : counts() { }
+  void add(const LatencyHistogram& source);
+  size_t count() const;
+  double percentile(double p) const;
+  void record(double seconds);
+  void reset() { counts.fill(0); }
+
+private:
+  static const size_t NUM_BUCKETS = 128;
+  std::array<size_t, NUM_BUCKETS> counts;
+};
+
+// TimingData holds the counters for the phases of the processing; each thread
+//   fills its own, and they are merged into the global one in file order
 class TimingData
 {
 public:
   TimingData() : thread(0.), db(0.), read(0.), write(0.), grib2u(0.),
-      grib2c(0.), nc(0.), read_bytes(0), num_reads(0) { }
+      grib2c(0.), nc(0.), read_bytes(0), num_reads(0), read_latency(),
+      decode_latency() { }
 
   void add(const TimingData& source) {
     thread += source.thread;
@@ -88,15 +131,45 @@ public:
     nc += source.nc;
     read_bytes += source.read_bytes;
     num_reads += source.num_reads;
+    read_latency.add(source.read_latency);
+    decode_latency.add(source.decode_latency);
   }
   void reset() {
     thread = db = read = write = grib2u = grib2c = nc = 0.;
     read_bytes = num_reads = 0;
+    read_latency.reset();
+    decode_latency.reset();
   }
 
   double thread, db, read, write, grib2u, grib2c, nc;
   long long read_bytes;
   int num_reads;
+  LatencyHistogram read_latency, decode_latency;
+};
+
+// ScheduleEstimate holds the estimated makespans (in bytes of input per
+//   thread) of the input files in database order and in scheduled order
+struct ScheduleEstimate {
+  ScheduleEstimate() : database_order(0), scheduled_order(0) { }
+
+  long long database_order, scheduled_order;
+};
+
+// InventoryFilter is the inventory conditions of the request in a form that
+//   can be applied to cached inventory rows; an empty set of codes doesn't
+//   restrict the rows
+struct InventoryFilter {
+  InventoryFilter() : start_date(0), end_date(0), dates_are_init(false),
+      is_multi_level(false), months(), time_range_codes(),
+      grid_definition_codes(), level_codes() { }
+
+  // the dates are zero if they don't restrict the rows; like the dates, the
+  //   months of the valid dates and the levels of a multi-level request aren't
+  //   part of the conditions without dates
+  long long start_date, end_date;
+  bool dates_are_init, is_multi_level;
+  std::unordered_set<int> months, time_range_codes, grid_definition_codes,
+      level_codes;
 };
 
 struct QueryData {
@@ -107,10 +180,11 @@ struct QueryData {
     std::string format, union_, union_non_date, level, inventory;
   };
 
-  QueryData() : conditions(), union_query() { }
+  QueryData() : conditions(), union_query(), filter() { }
 
   Conditions conditions;
   std::string union_query;
+  InventoryFilter filter;
 };
 
 struct CSVData {
@@ -119,6 +193,57 @@ struct CSVData {
   std::string parameter, level;
 };
 
+// ByteRecord is one inventory row: the location of a record in an input file
+struct ByteRecord {
+  ByteRecord() : offset(0), length(0), valid_date(), process() { }
+  ByteRecord(off_t o, size_t l, std::string v) : offset(o), length(l),
+      valid_date(v), process() { }
+  ByteRecord(off_t o, size_t l, std::string v, std::string p) : offset(o),
+      length(l), valid_date(v), process(p) { }
+
+  off_t offset;
+  size_t length;
+  std::string valid_date, process;
+};
+
+/* TaskPool runs batches of tasks on threads that live as long as the pool:
+**   run() hands a batch to the pool's threads and runs the tasks of the batch
+**     on the calling thread as well, so that the batch finishes even when the
+**     pool's threads are busy with other batches; it returns when all of the
+**     tasks are done, and rethrows the first exception thrown by a task
+**   the calling thread always runs the first task of a batch, and with at
+**     least one idle pool thread for each of the other tasks, all of the tasks
+**     run at the same time
+*/
+class TaskPool
+{
+public:
+  explicit TaskPool(size_t num_threads);
+  TaskPool(const TaskPool&) = delete;
+  TaskPool& operator=(const TaskPool&) = delete;
+  ~TaskPool();
+  void run(const std::vector<std::function<void()>>& tasks);
+
+private:
+  struct Batch {
+    explicit Batch(const std::vector<std::function<void()>>& t) : tasks(t),
+        next(0), num_done(0), error(nullptr) { }
+
+    const std::vector<std::function<void()>>& tasks;
+    size_t next, num_done;
+    std::exception_ptr error;
+  };
+
+  void run_next(std::unique_lock<std::mutex>& lock, Batch& batch);
+  void work();
+
+  std::deque<Batch *> batches;
+  std::mutex mutex;
+  std::condition_variable cond;
+  bool stopped;
+  std::vector<std::thread> threads;
+};
+
 const size_t OBUFFER_LENGTH = 2000000;
 struct ThreadData {
   ThreadData() : file_code(), file_id(), data_format(), data_format_code(),
@@ -127,8 +252,9 @@ struct ThreadData {
       multi_set(nullptr), include_parameter_codes_set(nullptr),
       filelist_display_order(0), f_attach(), size_input(0), fcount(0),
       parameter_mapper(nullptr), timing_data(), write_bytes(0),
-      obuffer(nullptr), s3_session(nullptr), has_started(false),
-      has_finished(false) { }
+      obuffer(nullptr), s3_session(nullptr), reader_s3_sessions(),
+      obj_store(), num_record_workers(1), governed_volume(0), file_retries(0),
+      stage_pool(nullptr), grid_pool(nullptr) { }
 
   std::string file_code, file_id, data_format, data_format_code, output_format;
   std::string webhome, filename, uConditions, uConditions_no_dates;
@@ -144,7 +270,180 @@ struct ThreadData {
   long long write_bytes;
   std::unique_ptr<unsigned char[]> obuffer;
   std::shared_ptr<s3::Session> s3_session;
-  bool has_started, has_finished;
+
+  // the object store sessions of the pipeline's readers; the first is
+  //   's3_session'
+  std::vector<std::shared_ptr<s3::Session>> reader_s3_sessions;
+  Directives::ObjectStore obj_store;
+  size_t num_record_workers;
+  long long governed_volume;
+  size_t file_retries;
+
+  // the threads of the worker's record pipeline and of the subsetting of the
+  //   grids within messages, started once for all of the worker's files
+  std::shared_ptr<TaskPool> stage_pool, grid_pool;
+};
+
+/* BlockingQueue is a thread-safe FIFO:
+**   pop() blocks until an item is available, and returns false once the queue
+**     has been closed and drained
+**   clear() discards any items that have not yet been popped
+*/
+template <class T>
+class BlockingQueue
+{
+public:
+  BlockingQueue() : queue(), mutex(), cond(), closed(false) { }
+  void clear() {
+    std::lock_guard<std::mutex> lock(mutex);
+    queue.clear();
+  }
+  void close() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      closed = true;
+    }
+    cond.notify_all();
+  }
+  bool pop(T& item) {
+    std::unique_lock<std::mutex> lock(mutex);
+    cond.wait(lock, [this] { return !queue.empty() || closed; });
+    if (queue.empty()) {
+      return false;
+    }
+    item = std::move(queue.front());
+    queue.pop_front();
+    return true;
+  }
+  void push(T item) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      queue.emplace_back(std::move(item));
+    }
+    cond.notify_one();
+  }
+
+private:
+  std::deque<T> queue;
+  std::mutex mutex;
+  std::condition_variable cond;
+  bool closed;
+};
+
+/* ConnectionPool keeps open connections to a database server, so that the
+**   threads can reuse them from file to file:
+**   get() returns a lease on an idle connection, opening a new one if fewer
+**     than 'max_connections' are open, and otherwise blocking until one is
+**     returned; it throws if a new connection fails
+**   the connection goes back to the pool when the lease is destroyed, unless
+**     it has been lost
+*/
+class ConnectionPool
+{
+public:
+  class Lease
+  {
+  public:
+    Lease(ConnectionPool& p, std::unique_ptr<PostgreSQL::Server> s) : pool(p),
+        server(std::move(s)) { }
+    Lease(const Lease&) = delete;
+    Lease(Lease&& source) : pool(source.pool), server(std::move(source.
+        server)) { }
+    Lease& operator=(const Lease&) = delete;
+    ~Lease() {
+      if (server != nullptr) {
+        pool.put(std::move(server));
+      }
+    }
+    PostgreSQL::Server& operator*() { return *server; }
+    PostgreSQL::Server *operator->() { return server.get(); }
+
+  private:
+    ConnectionPool& pool;
+    std::unique_ptr<PostgreSQL::Server> server;
+  };
+
+  ConnectionPool(const PostgreSQL::DBconfig& config, size_t max_connections,
+      int timeout) : CONFIG(config), MAX_CONNECTIONS(max_connections),
+      TIMEOUT(timeout), idle(), num_open(0), mutex(), cond() { }
+  ConnectionPool(const ConnectionPool&) = delete;
+  ConnectionPool& operator=(const ConnectionPool&) = delete;
+  ~ConnectionPool();
+  Lease get();
+
+private:
+  void put(std::unique_ptr<PostgreSQL::Server> server);
+
+  const PostgreSQL::DBconfig CONFIG;
+  const size_t MAX_CONNECTIONS;
+  const int TIMEOUT;
+  std::vector<std::unique_ptr<PostgreSQL::Server>> idle;
+  size_t num_open;
+  std::mutex mutex;
+  std::condition_variable cond;
+};
+
+/* PreparedStatements prepares the inventory query templates on the database
+**   connections that run them, once per connection; the templates of a run
+**   differ only in the file codes, which are the statements' parameter $1:
+**   execute() returns the statement that runs a template for a set of file
+**     codes, preparing the template first if the connection hasn't seen it;
+**     the file codes must be numeric
+**   forget() is called before a connection is closed
+*/
+class PreparedStatements
+{
+public:
+  PreparedStatements() : names(), prepared(), mutex() { }
+  PreparedStatements(const PreparedStatements&) = delete;
+  PreparedStatements& operator=(const PreparedStatements&) = delete;
+  std::string execute(PostgreSQL::Server& server, std::string definition,
+      const std::vector<std::string>& file_codes);
+  void forget(const PostgreSQL::Server& server);
+
+private:
+  std::unordered_map<std::string, std::string> names;
+  std::unordered_map<const PostgreSQL::Server *, std::unordered_set<
+      std::string>> prepared;
+  std::mutex mutex;
+};
+
+/* WfrqstRegistrar registers the output files of a request in dssdb.wfrqst in
+**   multi-row batches, instead of with one insert per file:
+**   add() buffers a registration, and flushes the buffer once it holds
+**     FLUSH_SIZE files
+**   flush() inserts everything that is buffered with one statement; if that
+**     fails, the registrations stay buffered for the next flush
+**   a file that is registered more than once keeps its last registration, as
+**     it would with one insert per registration
+*/
+class WfrqstRegistrar
+{
+public:
+  WfrqstRegistrar(ConnectionPool& rdadb_pool, std::string request_index) :
+      rdadb_pool(rdadb_pool), REQUEST_INDEX(request_index), buffer(),
+      mutex() { }
+  WfrqstRegistrar(const WfrqstRegistrar&) = delete;
+  WfrqstRegistrar& operator=(const WfrqstRegistrar&) = delete;
+  void add(std::string filename, std::string data_format, size_t
+      filelist_display_order);
+  void flush();
+
+private:
+  struct Registration {
+    Registration() : data_format(), filelist_display_order(0) { }
+    Registration(std::string f, size_t d) : data_format(f),
+        filelist_display_order(d) { }
+
+    std::string data_format;
+    size_t filelist_display_order;
+  };
+
+  static const size_t FLUSH_SIZE = 1000;
+  ConnectionPool& rdadb_pool;
+  const std::string REQUEST_INDEX;
+  std::unordered_map<std::string, Registration> buffer;
+  std::mutex mutex;
 };
 
 class InputDataSource
@@ -152,8 +451,11 @@ class InputDataSource
 public:
   enum class Type {_NULL, _POSIX, _S3};
 
-  InputDataSource() : type(Type::_NULL), posix(), s3(), read_buffer(nullptr),
-      BUF_LEN(0) { }
+  // the timings of the reads are recorded in 'timing_data', which must belong
+  //   to the calling thread
+  explicit InputDataSource(TimingData& timing_data) : type(Type::_NULL),
+      posix(), s3(), read_buffer(nullptr), BUF_LEN(0), timings(timing_data)
+      { }
   unsigned char *get() const { return read_buffer.get(); }
   void initialize(std::string posix_filename);
   void initialize(std::shared_ptr<s3::Session>& s3_session, std::string bucket,
@@ -176,6 +478,7 @@ private:
   } s3;
   std::unique_ptr<unsigned char[]> read_buffer;
   size_t BUF_LEN;
+  TimingData& timings;
 };
 
 struct SortData {
@@ -206,9 +509,311 @@ struct SortData {
 typedef std::tuple<std::string, std::string, long long, std::string,
     std::string> InputFile;
 
+// FileTask is a unit of work handed to the worker pool
+struct FileTask {
+  FileTask() : input_file(), filelist_display_order(0) { }
+  FileTask(const InputFile& file, size_t display_order) : input_file(file),
+      filelist_display_order(display_order) { }
+
+  InputFile input_file;
+  size_t filelist_display_order;
+};
+
+// FileResult is what a worker reports back to the main thread for each task
+struct FileResult {
+  FileResult() : filelist_display_order(0), wget_filenames(), fcount(0),
+      write_bytes(0), timing_data(), failure(), error(nullptr) { }
+
+  size_t filelist_display_order;
+  std::list<std::string> wget_filenames;
+  size_t fcount;
+  long long write_bytes;
+  TimingData timing_data;
+
+  // failure describes why the file could not be built after all of its
+  //   retries; error is set only when the whole run has to stop
+  std::string failure;
+  std::exception_ptr error;
+};
+
+// Cancellation is the process-wide signal that tells the workers to stop; the
+//   first reason given is the one that is reported
+class Cancellation
+{
+public:
+  Cancellation() : cancelled(false), mutex(), cond(), stdout_message(),
+      stderr_message() { }
+  void cancel(std::string stdout_msg, std::string stderr_msg) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (!cancelled) {
+        stdout_message = stdout_msg;
+        stderr_message = stderr_msg;
+        cancelled = true;
+      }
+    }
+    cond.notify_all();
+  }
+  bool is_cancelled() const { return cancelled; }
+
+  // wait_for() waits for up to 'duration', returning early if the run is
+  //   cancelled
+  template <class Duration> void wait_for(const Duration& duration) {
+    std::unique_lock<std::mutex> lock(mutex);
+    cond.wait_for(lock, duration, [this] { return cancelled.load(); });
+  }
+  std::string stderr_msg() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return stderr_message;
+  }
+  std::string stdout_msg() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return stdout_message;
+  }
+
+private:
+  std::atomic<bool> cancelled;
+  std::mutex mutex;
+  std::condition_variable cond;
+  std::string stdout_message, stderr_message;
+};
+
+class CancelledError : public std::runtime_error
+{
+public:
+  CancelledError() : std::runtime_error("processing was cancelled") { }
+};
+
+// VolumeGovernor keeps a running total of the output volume of the request;
+//   each file contributes its actual volume so far plus a projection for the
+//   rest of the file, and the run is cancelled as soon as the total goes over
+//   the cap
+class VolumeGovernor
+{
+public:
+  VolumeGovernor() : CAP(900000000000), volume(0) { }
+
+  long long total() const { return volume; }
+
+  // update() replaces the contribution of a file, 'file_volume', with
+  //   'new_volume'
+  void update(long long& file_volume, long long new_volume);
+
+private:
+  const long long CAP;
+  std::atomic<long long> volume;
+};
+
+// MemoryGovernor limits the bytes held in record and I/O buffers across all of
+//   the threads:
+//   acquire() blocks until at least 'min_bytes' fit under the limit, and then
+//     grants as much as it can, up to 'max_bytes'; it never blocks when
+//     nothing else is held, so that one large file can still be processed
+//   a limit of zero means no limit
+class MemoryGovernor
+{
+public:
+  MemoryGovernor() : mutex(), cond(), limit(0), in_use(0), max_demand(0) { }
+  long long acquire(long long min_bytes, long long max_bytes);
+  long long demand();
+  long long get_limit() const { return limit; }
+  void note_demand(long long num_bytes);
+  void release(long long num_bytes);
+  void set_limit(long long num_bytes) { limit = num_bytes; }
+
+private:
+  std::mutex mutex;
+  std::condition_variable cond;
+  long long limit, in_use, max_demand;
+};
+
+// FileInventory is the list of requested records in one input file, with the
+//   counts that decide whether the file can be linked as a full file
+struct FileInventory {
+  FileInventory() : records(), num_rows(0), num_rows_no_dates(-1),
+      is_full_file(false), is_streamed(false) { }
+
+  // the records are left empty for a file that has too many of them to hold
+  //   - it is streamed through an InventoryCursor instead
+  std::vector<ByteRecord> records;
+
+  // num_rows counts the records that meet the conditions of the request,
+  //   including any selection of months, which is a condition of the query;
+  //   num_rows_no_dates is -1 if the records without the date conditions
+  //   weren't counted, which they only are for the full-file check - it
+  //   leaves out the selection of months, so that a file with deselected
+  //   months isn't linked whole (the temporal subset flag, by contrast,
+  //   counts the months on both sides and is not set by months alone)
+  size_t num_rows;
+  long long num_rows_no_dates;
+  bool is_full_file, is_streamed;
+};
+
+// CachedInventoryRow is one row of an inventory table, as held in the
+//   inventory cache
+struct CachedInventoryRow {
+  long long byte_offset, byte_length, valid_date, init_date;
+  int level_code, time_range_code, grid_definition_code, process;
+};
+
+/* InventoryCache keeps copies of the inventory tables of a dataset on disk,
+**   one binary file per input file and parameter, whose rows are read
+**   straight into place:
+**     <directory>/<dsid>/<parameter_code>/<file_code>
+**   the cache is only used if <directory>/<dsid>/.version exists, and a copy
+**   is stale once the contents of that file differ from the contents when
+**   the copy was written; whatever loads the inventory of the dataset
+**   changes the version
+**   read() returns false if a copy is missing or stale, or doesn't have the
+**     columns that are needed
+**   write() replaces a copy, without a reader ever seeing a partial file
+*/
+class InventoryCache
+{
+public:
+  enum Columns { _INIT_DATE = 0x1, _PROCESS = 0x2 };
+  static const int NO_PROCESS = -2147483647 - 1;
+
+  InventoryCache() : directory(), version(), filter(), enabled(false) { }
+  void disable() { enabled = false; }
+  bool is_enabled() const { return enabled; }
+  bool matches(const CachedInventoryRow& row, bool apply_dates) const;
+  void open(std::string cache_directory, std::string dsid, const
+      InventoryFilter& inventory_filter);
+  bool read(std::string file_code, std::string parameter_code, int columns,
+      std::vector<CachedInventoryRow>& rows) const;
+  void write(std::string file_code, std::string parameter_code, int columns,
+      const std::vector<CachedInventoryRow>& rows) const;
+
+private:
+  std::string directory, version;
+  InventoryFilter filter;
+  std::atomic<bool> enabled;
+};
+
+// InventoryFile identifies an input file for an inventory query
+struct InventoryFile {
+  InventoryFile() : file_code(), data_format() { }
+  InventoryFile(std::string c, std::string f) : file_code(c), data_format(f)
+      { }
+
+  std::string file_code, data_format;
+};
+
+/* InventoryCursor hands out the records of a file in blocks:
+**   next() moves to the next block, and returns false once there are no more
+**   records() is the current block - all of the records at once if the
+**     inventory holds them, otherwise the next FETCH_SIZE rows (less any in
+**     unselected months) from a server-side cursor, so that a file with many
+**     records can be read as they arrive, without holding all of them
+**   progress() is the fraction of the rows of the file that have been fetched
+*/
+class InventoryCursor
+{
+public:
+  InventoryCursor(const FileInventory& inventory, ConnectionPool& metadb_pool,
+      InventoryFile file, std::string conditions);
+  InventoryCursor(const InventoryCursor&) = delete;
+  InventoryCursor& operator=(const InventoryCursor&) = delete;
+  ~InventoryCursor();
+  bool next();
+  double progress() const;
+  const std::vector<ByteRecord>& records() const {
+    return inventory.is_streamed ? block : inventory.records;
+  }
+
+private:
+  static const size_t FETCH_SIZE = 16384;
+  const FileInventory& inventory;
+  ConnectionPool& metadb_pool;
+  const InventoryFile INVENTORY_FILE;
+  const std::string CONDITIONS;
+  std::unique_ptr<ConnectionPool::Lease> server;
+  std::vector<ByteRecord> block;
+  size_t num_rows_fetched;
+  bool is_started, is_done;
+};
+
+// InventoryPrefetcher queries the inventories of the next 'depth' queued files
+//   in the background, in batches of files, so that a worker can start reading
+//   as soon as it picks up a file
+class InventoryPrefetcher
+{
+public:
+  InventoryPrefetcher(const std::vector<FileTask>& tasks, size_t depth,
+      std::string conditions, std::string conditions_no_dates, ConnectionPool&
+      metadb_pool);
+  InventoryPrefetcher(const InventoryPrefetcher&) = delete;
+  InventoryPrefetcher& operator=(const InventoryPrefetcher&) = delete;
+  ~InventoryPrefetcher();
+
+  // take() returns the inventory of a file, waiting for it if it is in
+  //   progress; nullptr means that the worker should query the inventory
+  //   itself
+  std::unique_ptr<FileInventory> take(std::string file_code);
+
+  // skip() tells the prefetcher that a file won't need its inventory
+  void skip(std::string file_code);
+
+private:
+  enum class State {_QUEUED, _RUNNING, _READY, _CLAIMED};
+  struct Entry {
+    Entry() : file_code(), data_format(), state(State::_QUEUED),
+        inventory(nullptr), is_taken(false) { }
+
+    std::string file_code, data_format;
+    State state;
+    std::unique_ptr<FileInventory> inventory;
+
+    // a retried file takes its entry again, but only moves the window once
+    bool is_taken;
+  };
+
+  void run();
+
+  const size_t DEPTH;
+  const std::string CONDITIONS, CONDITIONS_NO_DATES;
+  ConnectionPool& metadb_pool;
+  std::vector<Entry> entries;
+  std::unordered_map<std::string, size_t> index_map;
+  std::mutex mutex;
+  std::condition_variable cond;
+  size_t num_taken;
+  bool stopped;
+  std::thread prefetch_thread;
+};
+
+// RequestWatcher checks the status of the request in dssdb.dsrqst every
+//   INTERVAL seconds while the files are being built, and cancels the run if the
+//   request has been purged or has been set to an error status
+class RequestWatcher
+{
+public:
+  explicit RequestWatcher(ConnectionPool& rdadb_pool);
+  RequestWatcher(const RequestWatcher&) = delete;
+  RequestWatcher& operator=(const RequestWatcher&) = delete;
+  ~RequestWatcher();
+
+private:
+  void run();
+
+  static const int INTERVAL = 60;
+  ConnectionPool& rdadb_pool;
+  std::mutex mutex;
+  std::condition_variable cond;
+  bool stopped;
+  std::thread watch_thread;
+};
+
 extern Args args;
 extern RequestValues request_values;
 extern TimingData timing_data;
+extern Cancellation cancellation;
+extern VolumeGovernor volume_governor;
+extern MemoryGovernor memory_governor;
+extern InventoryCache inventory_cache;
+extern PreparedStatements prepared_statements;
+extern ScheduleEstimate schedule_estimate;
 extern PostgreSQL::Server metadata_server, rdadb_server;
 extern char locflag;
 
@@ -216,10 +821,12 @@ extern "C" void clean_up();
 
 extern void build_query_constructs(QueryData& query_data);
 extern void build_subset_files(const std::vector<InputFile>& input_files,
-    const std::unordered_set<std::string>& multiple_parameter_files_code_set,
-    ThreadData *thread_data, std::vector<std::string>& wget_list, long long&
-    size_input, size_t& fcount, bool& is_temporal_subset);
+    const std::vector<size_t>& display_orders, ThreadData *thread_data, std::
+    vector<std::string>& wget_list, long long& size_input, size_t& fcount,
+    bool& is_temporal_subset);
 extern void check_usage(int argc);
+extern void clear_shard_results();
+extern void clear_stale_wfrqst_rows(const std::vector<std::string>& wget_list);
 extern void create_download_scripts(const std::vector<std::string>& wget_list,
     std::string dsrqst_root);
 extern void do_conversion(ThreadData& thread_data);
@@ -230,6 +837,10 @@ extern void get_chunk(std::ifstream& ifs, off_t offset, size_t num_bytes,
 extern void get_chunk(s3::Session& session, std::string bucket, std::string key,
     off_t offset, size_t num_bytes, std::unique_ptr<unsigned char[]>& buffer,
     size_t& BUF_LEN);
+extern void load_parameter_codes(PostgreSQL::Server& server);
+extern bool has_temporal_subset(PostgreSQL::Server& server, const std::vector<
+    InputFile>& input_files, std::string conditions, std::string
+    conditions_no_dates);
 extern void insert_into_wfrqst(PostgreSQL::Server& server, std::string
     request_index, std::string filename, std::string data_format, size_t
     filelist_display_order);
@@ -239,29 +850,49 @@ extern void parse_subset_request(std::string dataset_block, int& num_parameters,
     unique_formats_map, std::shared_ptr<std::unordered_set<std::string>>&
     include_parameter_codes_set);
 extern void print_timings();
+extern void query_inventories(PostgreSQL::Server& server, const std::vector<
+    InventoryFile>& files, std::string conditions, std::string
+    conditions_no_dates, std::vector<FileInventory>& inventories);
+extern void read_shard_manifests(std::vector<std::string>& wget_list, long
+    long& size_input, size_t& fcount, bool& is_temporal_subset);
 extern void set_fcount(std::string request_index, size_t fcount);
+extern void submit_merge_job();
 extern void sort_to_nc_order(std::string input_filename, std::string
     output_filename);
+extern void throw_if_cancelled();
 extern void terminate(std::string stdout_message, std::string stderr_message);
 extern void update_subflag_bit(short bit, short& subflag, void *data);
 extern void update_rdadb(long long size_input, size_t fcount, std::string
     dsrqst_note, short subflag);
+extern void write_shard_manifest(const std::vector<std::string>& wget_list,
+    long long size_input, size_t fcount, bool is_temporal_subset, long long
+    volume, bool has_errors);
 
+extern size_t available_cpus();
 extern size_t combine_csv_files(std::vector<std::string>& wget_list, const
     CSVData& csv_data);
+extern size_t default_num_threads(const std::vector<InputFile>& input_files);
 
+extern long long default_memory_limit(const Directives& directives);
+
+extern std::string failed_files_filename();
+extern std::string month_condition();
 extern std::string create_user_email_notice(xmlutils::ParameterMapper&
     parameter_mapper, xmlutils::LevelMapper& level_mapper,
     std::unordered_map<std::string, std::string>& unique_formats_map);
 extern std::string batch_options(const Directives& directives);
-extern std::string parameter_code(PostgreSQL::Server& server, std::string
-    parameter);
+extern std::string parameter_code(std::string parameter);
 
 extern std::unordered_set<std::string> multiple_parameter_files(const
     std::vector<InputFile>& input_files, std::string inventory_conditions);
 
 extern std::vector<InputFile> input_files(const QueryData& query_data);
 
+extern std::vector<size_t> schedule_input_files(const std::vector<InputFile>&
+    input_files, size_t num_threads);
+extern std::vector<size_t> shard_input_files(std::vector<InputFile>&
+    input_files);
+
 extern CSVData csv_data(xmlutils::ParameterMapper& parameter_mapper,
     xmlutils::LevelMapper& level_mapper, std::unordered_map<std::string,
     std::string>& unique_formats_map);
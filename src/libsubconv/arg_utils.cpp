@@ -1,3 +1,4 @@
+#include <cstdlib>
 #include <iostream>
 #include <subconv.hpp>
 #include <strutils.hpp>
@@ -10,7 +11,7 @@ namespace subconv {
 
 void check_usage(int argc)
 {
-  if (argc < 3 || argc > 6) {
+  if (argc < 3 || argc > 10) {
     cerr << "USAGE: subconv [OPTIONS...] REQUEST_NUMBER DIRECTORY" << endl;
     cerr << "\nSYNOPSIS:" << endl;
     cerr << "    Process a dsrqst request by performing some combination of "
@@ -28,12 +29,22 @@ void check_usage(int argc)
         "processing" << endl;
     cerr << "  -R    ignore user restrictions and process request" << endl;
     cerr << "  -t    turn on internal timings" << endl;
+    cerr << "  --shard <i>/<N>\n        build only shard i (0 to N-1) of the "
+        "input files; the shards" << endl;
+    cerr << "        are combined afterwards with --merge" << endl;
+    cerr << "  --merge <N>\n        combine the results of the N shards of the "
+        "request and finish" << endl;
+    cerr << "        it, instead of building any files" << endl;
     cerr << "\n-OR-\n" << endl;
     cerr << "USAGE: subconv -B | -Q REQUEST_NUMBER" << endl;
     cerr << "\nSYNOPSIS:" << endl;
     cerr << "    Return a string of \"sbatch\" options that would be "
         "appropriate for the given" << endl;
-    cerr << "    request number." << endl;
+    cerr << "    request number. A large request gets a job array of shards; "
+        "each array task" << endl;
+    cerr << "    builds the shard of its array index, and the first task "
+        "submits the --merge" << endl;
+    cerr << "    run that finishes the request after the array." << endl;
     cerr << "\nREQUIRED:" << endl;
     cerr << "  -B    indicates that this is an \"sbatch\" options run" << endl;
     cerr << "  -Q    indicates that this is an \"qsub\" options run" << endl;
@@ -86,9 +97,49 @@ void parse_args(int argc, char **argv)
 	args.rinfo = parts[++next];
 	args.download_directory = "x";
 	args.is_test = true;
+    } else if (parts[next] == "--merge") {
+	args.num_shards = std::stoi(parts[++next]);
+	args.merge_shards = true;
+    } else if (parts[next] == "--shard") {
+	auto sp = strutils::split(parts[++next], "/");
+	if (sp.size() != 2) {
+	  throw std::runtime_error("parse_args(): bad shard '" + parts[next] +
+	      "', should be <i>/<N>");
+	}
+	args.shard_index = std::stoi(sp[0]);
+	args.num_shards = std::stoi(sp[1]);
+	if (args.shard_index >= args.num_shards) {
+	  throw std::runtime_error("parse_args(): bad shard '" + parts[next] +
+	      "', i must be less than N");
+	}
     }
     ++next;
   }
+  if (args.batch_type == 0x0 && !args.is_test && args.num_shards == 0 &&
+      getenv("SUBCONV_NUM_SHARDS") != nullptr) {
+
+    // a task of the job array that batch_options() asked for is the shard of
+    //   its array index
+    auto index = getenv("SLURM_ARRAY_TASK_ID");
+    if (index == nullptr) {
+      index = getenv("PBS_ARRAY_INDEX");
+    }
+    if (index == nullptr) {
+      throw std::runtime_error("parse_args(): SUBCONV_NUM_SHARDS is set, but "
+          "the job array index is not");
+    }
+    args.shard_index = std::stoi(index);
+    args.num_shards = std::stoi(getenv("SUBCONV_NUM_SHARDS"));
+    args.is_array_task = true;
+    if (args.shard_index >= args.num_shards) {
+      throw std::runtime_error("parse_args(): job array index " + std::string(
+          index) + " is not less than the number of shards");
+    }
+  }
+  if (args.merge_shards && args.num_shards == 0) {
+    throw std::runtime_error("parse_args(): the number of shards to merge must "
+        "be greater than zero");
+  }
   if (args.batch_type == 0x0 && !args.is_test) {
     args.rqst_index = parts[next++];
     args.download_directory = parts[next++];
@@ -28,6 +28,22 @@ string batch_options(const Directives& directives) {
   if (cpus_per_task == 0) {
     cpus_per_task = 1;
   }
+
+  // when the test run has seen the records, size the memory from the buffers
+  //   that the threads will need, plus a base amount; without a configured
+  //   limit, the job's memory governor gets 3/4 of the job's memory, so ask for
+  //   4/3 of the buffers
+  auto demand = memory_governor.demand();
+  if (demand > 0) {
+    auto buffer_bytes = static_cast<long long>(args.num_threads) * demand;
+    if (directives.memory_limit > 0) {
+      buffer_bytes = std::min(buffer_bytes, directives.memory_limit);
+    } else {
+      buffer_bytes = buffer_bytes / 3 * 4;
+    }
+    mem = strutils::lltos((buffer_bytes + (128LL << 20) + (1LL << 20) - 1) >>
+        20) + "M";
+  }
   auto time_minutes = 0;
   if ( (timing_data.num_reads & 0x40000000) == 0x40000000) {
     timing_data.num_reads = timing_data.num_reads & 0x2fffffff;
@@ -63,8 +79,18 @@ string batch_options(const Directives& directives) {
     throw std::runtime_error("batch_options(): unable to set priority (" +
         priority + ") for request index " + args.rqst_index);
   }
+
+  // a request that would run past the walltime limit is split into a job array
+  //   of shards ('subconv --shard <i>/<N>'), each getting an equal share of the
+  //   time; 'subconv --merge <N>' finishes the request after the array is done
+  const int MAX_TIME_MINUTES = 1410, MAX_SHARDS = 64;
+  auto num_shards = std::min((time_minutes + MAX_TIME_MINUTES - 1) /
+      MAX_TIME_MINUTES, MAX_SHARDS);
+  if (num_shards > 1) {
+    time_minutes = (time_minutes + num_shards - 1) / num_shards;
+  }
   short hr, min;
-  time_minutes = std::min(time_minutes, 1410);
+  time_minutes = std::min(time_minutes, MAX_TIME_MINUTES);
   hr = time_minutes / 60;
   min = (time_minutes % 60);
   if (min < 30) {
@@ -78,6 +104,12 @@ string batch_options(const Directives& directives) {
     case 'B': {
       batch_options << "--cpus-per-task=" << cpus_per_task * 2 << " --mem=" <<
           mem << " -t " << hr << ":" << setw(2) << setfill('0') << min << ":00";
+      if (num_shards > 1) {
+
+        // the array tasks find their shards from their array indexes
+        batch_options << " --array=0-" << num_shards - 1 << " --export=ALL,"
+            "SUBCONV_NUM_SHARDS=" << num_shards;
+      }
       break;
     }
     case 'Q': {
@@ -97,6 +129,10 @@ string batch_options(const Directives& directives) {
       }
       batch_options << ",walltime=" << setw(2) << setfill('0') << hr << ":" <<
           setw(2) << min << ":00";
+      if (num_shards > 1) {
+        batch_options << " -J 0-" << num_shards - 1 << " -v SUBCONV_NUM_SHARDS="
+            << num_shards;
+      }
       break;
     }
   }
@@ -11,8 +11,28 @@ using strutils::split;
 
 namespace subconv {
 
+// month_condition() is the condition on the valid dates for a selection of
+//   months, or empty if no month is actually selected
+string month_condition() {
+  string months;
+  if (request_values.topt_mo[0]) {
+    for (int n = 1; n < 13; ++n) {
+      if (request_values.topt_mo[n]) {
+        append(months, string(n < 10 ? "'0" : "'") + std::to_string(n) + "'",
+            ", ");
+      }
+    }
+  }
+  if (months.empty()) {
+    return "";
+  }
+  return "substr(valid_date::text, 5, 2) in (" + months + ")";
+}
+
 void build_query_constructs(QueryData& query_data)
 {
+  auto& filter = query_data.filter;
+  filter.dates_are_init = request_values.dates_are_init;
   if (!request_values.startdate.empty()) {
     if (request_values.dates_are_init) {
       append(query_data.conditions.inventory, "init_date", " and ");
@@ -20,6 +40,7 @@ void build_query_constructs(QueryData& query_data)
       append(query_data.conditions.inventory, "valid_date", " and ");
     }
     query_data.conditions.inventory += " >= '" + request_values.startdate + "'";
+    filter.start_date = std::stoll(request_values.startdate);
   }
   if (!request_values.enddate.empty()) {
     if (request_values.dates_are_init) {
@@ -28,6 +49,22 @@ void build_query_constructs(QueryData& query_data)
       append(query_data.conditions.inventory, "valid_date", " and ");
     }
     query_data.conditions.inventory += " <= '" + request_values.enddate + "'";
+    filter.end_date = std::stoll(request_values.enddate);
+  }
+
+  // a selection of months is a condition on the valid dates, so that the rows
+  //   of the other months never leave the database and the files that only
+  //   have those months aren't selected
+  if (request_values.topt_mo[0]) {
+    for (int n = 1; n < 13; ++n) {
+      if (request_values.topt_mo[n]) {
+        filter.months.emplace(n);
+      }
+    }
+  }
+  auto months = month_condition();
+  if (!months.empty()) {
+    append(query_data.conditions.inventory, months, " and ");
   }
   if (!request_values.product.empty()) {
     if (request_values.product.find(",") != string::npos) {
@@ -35,6 +72,7 @@ void build_query_constructs(QueryData& query_data)
       string tr_set;
       for (const auto& p : sp) {
           append(tr_set, p, ", ");
+          filter.time_range_codes.emplace(std::stoi(p));
       }
       append(query_data.conditions.inventory, "time_range_code in (" + tr_set +
           ")", " and ");
@@ -45,6 +83,7 @@ void build_query_constructs(QueryData& query_data)
           request_values.product, " and ");
       append(query_data.conditions.union_non_date, "time_range_code = " +
           request_values.product, " and ");
+      filter.time_range_codes.emplace(std::stoi(request_values.product));
     }
   }
   if (!request_values.grid_definition.empty()) {
@@ -53,6 +92,7 @@ void build_query_constructs(QueryData& query_data)
       string g_set;
       for (const auto& p : sp) {
           append(g_set, p, ", ");
+          filter.grid_definition_codes.emplace(std::stoi(p));
       }
       append(query_data.conditions.inventory, "grid_definition_code in (" +
           g_set + ")", " and ");
@@ -63,6 +103,8 @@ void build_query_constructs(QueryData& query_data)
           request_values.grid_definition, " and ");
       append(query_data.conditions.union_non_date, "grid_definition_code = " +
           request_values.grid_definition, " and ");
+      filter.grid_definition_codes.emplace(std::stoi(request_values.
+          grid_definition));
     }
   }
   query_data.conditions.union_ = query_data.conditions.inventory;
@@ -102,6 +144,7 @@ void build_query_constructs(QueryData& query_data)
           request_values.level, " and ");
       append(query_data.conditions.inventory, "level_code = " + request_values.
           level, " and ");
+      filter.level_codes.emplace(std::stoi(request_values.level));
     }
   }
   if (!request_values.parameters.empty()) {
@@ -110,7 +153,7 @@ void build_query_constructs(QueryData& query_data)
     for (const auto& parameter : request_values.parameters) {
       append(query_data.union_query, "select distinct file_code from \"IGrML\"."
           + request_values.metadata_dsid + "_inventory_" + parameter_code(
-          metadata_server, parameter), " union ");
+          parameter), " union ");
       if (!level_map.empty()) {
         level_conditions = "";
         auto level_key = strutils::token(parameter, ".", 0);
@@ -124,6 +167,8 @@ void build_query_constructs(QueryData& query_data)
             if (unique_level_set.find(p) == unique_level_set.end()) {
               append(query_data.conditions.level, "level_code = " + p, " or ");
               unique_level_set.emplace(p);
+              filter.level_codes.emplace(std::stoi(p));
+              filter.is_multi_level = true;
             }
           }
           level_conditions = "(" + level_conditions + ")";
@@ -1,3 +1,8 @@
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <map>
 #include <unordered_map>
 #include <unordered_set>
 #include <sstream>
@@ -18,6 +23,7 @@ using grid_to_netcdf::GridData;
 using NCTime = NetCDF::Time;
 using NCType = NetCDF::NCType;
 using VariableData = NetCDF::VariableData;
+using std::cerr;
 using std::endl;
 using std::ofstream;
 using std::ref;
@@ -30,6 +36,7 @@ using std::string;
 using std::stringstream;
 using std::thread;
 using std::tie;
+using std::to_string;
 using std::unique_ptr;
 using std::unordered_map;
 using std::unordered_set;
@@ -79,6 +86,14 @@ struct OutputStream {
   OutputNetCDFStream onc;
 };
 
+// move_file() renames a finished file into place; a file that can't be moved
+//   is an error, so that it is never counted or registered
+void move_file(string from_file, string to_file) {
+  if (std::rename(from_file.c_str(), to_file.c_str()) != 0) {
+    throw runtime_error("Error moving " + from_file + " to " + to_file);
+  }
+}
+
 bool check_for(string filename, ThreadData& thread_data) {
   struct stat buf;
   if (stat(filename.c_str(), &buf) == 0) {
@@ -165,78 +180,6 @@ bool file_exists(ThreadData& thread_data, unique_ptr<unordered_set<string>>&
   return file_exists;
 }
 
-void build_queries(Server& server, const ThreadData& thread_data, LocalQuery&
-    byte_query, LocalQuery& byte_query_no_dates, LocalQuery&
-    query_count_files) {
-  string union_query = "";
-  string union_query_no_dates = "";
-  for (const auto& parameter : request_values.parameters) {
-    if (request_values.ststep || request_values.topt_mo[0] ||
-        to_lower(request_values.ofmt) == "csv") {
-      append(union_query, "select byte_offset, byte_length, valid_date from "
-          "\"IGrML\"." + metautils::args.dsid + "_inventory_" + parameter_code(
-          server, parameter) + " where file_code = " + thread_data.file_code +
-          " and " + thread_data.uConditions, " union ");
-      append(union_query_no_dates, "select byte_offset, byte_length, "
-          "valid_date from \"IGrML\"." + metautils::args.dsid + "_inventory_" +
-          parameter_code(server, parameter) + " where file_code = " +
-          thread_data.file_code, " union ");
-      if (!thread_data.uConditions_no_dates.empty()) {
-        union_query_no_dates += " and " + thread_data.uConditions_no_dates;
-      }
-      if (parameter == request_values.parameters.back()) {
-        byte_query.set("select distinct byte_offset, byte_length, valid_date "
-            "from (" + union_query + ") as u order by valid_date, byte_offset");
-        byte_query_no_dates.set("select distinct byte_offset, byte_length, "
-            "valid_date from (" + union_query_no_dates + ") as u order by "
-            "valid_date, byte_offset");
-      }
-    } else if (to_lower(thread_data.data_format) == "netcdf" &&
-        request_values.ofmt.empty()) {
-      append(union_query, "select byte_offset, byte_length, valid_date, "
-          "process from \"IGrML\"." + metautils::args.dsid + "_inventory_" +
-          parameter_code(server, parameter) + " where file_code = " +
-          thread_data.file_code + " and " + thread_data.uConditions, " union ");
-      append(union_query_no_dates, "select byte_offset, byte_length, "
-          "valid_date, process from \"IGrML\"." + metautils::args.dsid +
-          "_inventory_" + parameter_code(server, parameter) + " where file_code "
-          "= " + thread_data.file_code, " union ");
-      if (!thread_data.uConditions_no_dates.empty()) {
-        union_query_no_dates += " and " + thread_data.uConditions_no_dates;
-      }
-      if (parameter == request_values.parameters.back()) {
-        byte_query.set("select distinct byte_offset, byte_length, valid_date, "
-            "process from (" + union_query + ") as u order by valid_date");
-        byte_query_no_dates.set("select distinct byte_offset, byte_length, "
-            "valid_date, process from (" + union_query_no_dates + ") as u "
-            "order by valid_date");
-        if (request_values.nlat > 99.) {
-          query_count_files.set("select count(byte_offset) from (" +
-              union_query_no_dates + ") as u");
-        }
-      }
-    } else {
-      append(union_query, "select byte_offset, byte_length from \"IGrML\"." +
-          metautils::args.dsid + "_inventory_" + parameter_code(server,
-          parameter) + " where file_code = " + thread_data.file_code + " and " +
-          thread_data.uConditions, " union ");
-      append(union_query_no_dates, "select byte_offset, byte_length from "
-          "\"IGrML\"." + metautils::args.dsid + "_inventory_" + parameter_code(
-          server, parameter) + " where file_code = " + thread_data.file_code,
-          " union ");
-      if (!thread_data.uConditions_no_dates.empty()) {
-        union_query_no_dates += " and " + thread_data.uConditions_no_dates;
-      }
-      if (parameter == request_values.parameters.back()) {
-        byte_query.set("select distinct byte_offset, byte_length from (" +
-            union_query + ") as u order by byte_offset");
-        byte_query_no_dates.set("select distinct byte_offset, byte_length from "
-            "(" + union_query_no_dates + ") as u order by byte_offset");
-      }
-    }
-  }
-}
-
 void write_netcdf_subset_header(string request_index, string input_file,
     OutputNetCDFStream& onc, NCTime& nc_time, SpatialBitmap& spatial_bitmap,
     int& num_values_in_subset) {
@@ -431,32 +374,21 @@ void write_netcdf_subset_header(string request_index, string input_file,
 
 bool linked_to_full_file(const ThreadData& thread_data, OutputStream& outs,
     NCTime& nc_time, SpatialBitmap& spatial_bitmap, int& num_values_in_subset,
-    Server& srv, LocalQuery& query_count_files, size_t byte_query_num_rows) {
+    const FileInventory& inventory) {
   bool linked_to_full_file = false;
   num_values_in_subset = 0;
   if (!args.is_test) {
-    if (query_count_files) {
-      if (query_count_files.submit(srv) < 0) {
-        throw runtime_error("linked_to_full_file(): " +
-            query_count_files.error() + " for query '" +
-            query_count_files.show() + "'");
-      }
-      Row row;
-      if (!query_count_files.fetch_row(row) || row[0].empty()) {
-        throw runtime_error("linked_to_full_file(): error getting file count");
-      }
-      if (stoi(row[0]) == static_cast<int>(byte_query_num_rows)) {
-std::cerr << "**linked '" << thread_data.webhome+"/"+thread_data.file_id << "' to '" << args.download_directory+thread_data.filename << "'" << endl;
-        stringstream oss, ess;
-        mysystem2("/bin/ln -s " + thread_data.webhome + "/" +
-            thread_data.file_id + " " + args.download_directory +
-            thread_data.filename,oss,ess);
-        if (!ess.str().empty()) {
-          throw runtime_error("linked_to_full_file(): link error: '" +
-              ess.str() + "'");
-        }
-        linked_to_full_file = true;
+    if (inventory.is_full_file) {
+cerr << "**linked '" << thread_data.webhome+"/"+thread_data.file_id << "' to '" << args.download_directory+thread_data.filename << "'" << endl;
+      stringstream oss, ess;
+      mysystem2("/bin/ln -s " + thread_data.webhome + "/" +
+          thread_data.file_id + " " + args.download_directory +
+          thread_data.filename,oss,ess);
+      if (!ess.str().empty()) {
+        throw runtime_error("linked_to_full_file(): link error: '" +
+            ess.str() + "'");
       }
+      linked_to_full_file = true;
     }
     if (!linked_to_full_file) {
       if (to_lower(thread_data.data_format) == "netcdf" && request_values.ofmt
@@ -513,6 +445,8 @@ void build_netcdf_subset(InputDataSource& input_data, long long offset_to_chunk,
       if (args.get_timings) {
         grib2u_timer.stop();
         thread_data.timing_data.grib2u += grib2u_timer.elapsed_time();
+        thread_data.timing_data.decode_latency.record(grib2u_timer.
+            elapsed_time());
       }
       for (size_t n = 0; n < num_grids; ++n) {
         Grid *grid = nullptr;
@@ -591,15 +525,528 @@ void build_csv_subset(InputDataSource& input_data, long long offset_to_chunk,
   }
 }
 
+// the grids of a GRIB2 message share state with the message, so each thread
+//   that subsets grids of a message decodes its own copy of the message from
+//   the record; the copies are kept from message to message
+using GRIB2Copies = std::vector<unique_ptr<GRIB2Message>>;
+
+// the Gaussian latitudes are loaded by the grid library, which is not known
+//   to be thread-safe, so setting their path and subsetting Gaussian grids
+//   are done one at a time
+std::mutex gaussian_latitude_mutex;
+
+// subset_grib2_grids() creates the spatial subsets of the selected grids in a
+//   GRIB2 message, decoded from 'record'; with more than one thread, the grids
+//   are shared out among the tasks of the worker's grid pool, and each subset
+//   goes in the slot of its grid, so that the message keeps its original grid
+//   order
+void subset_grib2_grids(const ThreadData& thread_data, unsigned char *record,
+    GRIB2Message& msg, GRIB2Copies& msg_copies, size_t num_threads, std::
+    vector<GRIB2Grid>& sgrids, std::vector<char>& is_selected) {
+  auto num_grids = msg.number_of_grids();
+  sgrids.clear();
+  sgrids.resize(num_grids);
+  is_selected.assign(num_grids, 0);
+  auto subset_grids = [&](GRIB2Message& message, size_t first, size_t
+      stride) {
+    for (auto n = first; n < num_grids; n += stride) {
+      auto grid = message.grid(n);
+      {
+        std::lock_guard<std::mutex> lock(gaussian_latitude_mutex);
+        grid->set_path_to_gaussian_latitude_data(args.SHARE_DIRECTORY +
+            "/GRIB");
+      }
+      if (is_selected_parameter(thread_data, grid)) {
+        std::unique_lock<std::mutex> lock(gaussian_latitude_mutex, std::
+            defer_lock);
+        if (grid->definition().type == Grid::Type::gaussianLatitudeLongitude) {
+          lock.lock();
+        }
+        sgrids[n] = (reinterpret_cast<GRIB2Grid *>(grid))->create_subset(
+            request_values.slat, request_values.nlat, 1, request_values.wlon,
+            request_values.elon, 1);
+        switch (sgrids[n].data_representation()) {
+          case 2:
+          case 3: {
+            sgrids[n].set_data_representation(0);
+            break;
+          }
+        }
+        is_selected[n] = 1;
+      }
+    }
+  };
+  num_threads = std::min(num_threads, num_grids);
+  if (num_threads <= 1 || thread_data.grid_pool == nullptr) {
+    subset_grids(msg, 0, 1);
+    return;
+  }
+  while (msg_copies.size() < num_threads - 1) {
+    msg_copies.emplace_back(new GRIB2Message);
+  }
+  std::vector<std::function<void()>> tasks;
+  tasks.emplace_back([&, num_threads] { subset_grids(msg, 0, num_threads); });
+  for (size_t n = 1; n < num_threads; ++n) {
+    tasks.emplace_back([&, n, num_threads] {
+      auto& copy = *msg_copies[n - 1];
+      copy.fill(record, false);
+      subset_grids(copy, n, num_threads);
+    });
+  }
+  thread_data.grid_pool->run(tasks);
+}
+
+// subset_record() applies any spatial subsetting to a native-format record
+//   and returns the number of bytes to write; 'output' is pointed at either the
+//   record itself or at the subsetted message in 'obuffer'; the grids of a
+//   GRIB2 message are subset with up to 'num_grid_threads' threads
+int subset_record(const ThreadData& thread_data, void *msg, GRIB2Copies&
+    msg_copies, unsigned char *record, int num_bytes, unique_ptr<unsigned
+    char[]>& obuffer, TimingData& timing_data, size_t num_grid_threads,
+    unsigned char **output) {
+  const string THIS_FUNC = __func__;
+  *output = record;
+  if (request_values.nlat < 9999. && request_values.elon < 9999. &&
+      request_values.slat > -9999. && request_values.wlon > -9999.) {
+    Timer record_timer;
+    if (args.get_timings) {
+      record_timer.start();
+    }
+    if (thread_data.data_format == "WMO_GRIB1") {
+      reinterpret_cast<GRIBMessage *>(msg)->fill(record, false);
+      auto grid = reinterpret_cast<GRIBMessage *>(msg)->grid(0);
+      if (is_selected_parameter(thread_data, grid)) {
+        GRIBMessage smsg;
+        smsg.initialize(1, nullptr, 0, true, true);
+        GRIBGrid sgrid;
+        {
+          std::lock_guard<std::mutex> lock(gaussian_latitude_mutex);
+          grid->set_path_to_gaussian_latitude_data(args.SHARE_DIRECTORY +
+              "/GRIB");
+        }
+        sgrid = create_subset_grid(*(reinterpret_cast<GRIBGrid *>(grid)),
+            request_values.slat, request_values.nlat, request_values.wlon,
+            request_values.elon);
+        if (sgrid.is_filled()) {
+          smsg.append_grid(&sgrid);
+          if (obuffer == nullptr) {
+            obuffer.reset(new unsigned char[OBUFFER_LENGTH]);
+          }
+          num_bytes = smsg.copy_to_buffer(obuffer.get(), OBUFFER_LENGTH);
+        } else {
+          num_bytes = 0;
+        }
+      }
+    } else if (thread_data.data_format == "WMO_GRIB2") {
+      Timer grib2u_timer;
+      if (args.get_timings) {
+        grib2u_timer.start();
+      }
+      reinterpret_cast<GRIB2Message *>(msg)->fill(record, false);
+      Timer grib2c_timer;
+      if (args.get_timings) {
+        grib2u_timer.stop();
+        timing_data.grib2u += grib2u_timer.elapsed_time();
+        grib2c_timer.start();
+      }
+      GRIB2Message smsg2;
+      smsg2.initialize(2, nullptr, 0, true, true);
+      std::vector<GRIB2Grid> sgrids;
+      std::vector<char> is_selected;
+      subset_grib2_grids(thread_data, record, *reinterpret_cast<GRIB2Message *>(
+          msg), msg_copies, num_grid_threads, sgrids, is_selected);
+      for (size_t n = 0; n < sgrids.size(); ++n) {
+        if (is_selected[n]) {
+          smsg2.append_grid(&sgrids[n]);
+        }
+      }
+      if (obuffer == nullptr) {
+        obuffer.reset(new unsigned char[OBUFFER_LENGTH]);
+      }
+      num_bytes = smsg2.copy_to_buffer(obuffer.get(), OBUFFER_LENGTH);
+      if (args.get_timings) {
+        grib2c_timer.stop();
+        timing_data.grib2c += grib2c_timer.elapsed_time();
+      }
+    } else {
+      throw runtime_error(THIS_FUNC + "(): unable to create subset for "
+          "format '" + thread_data.data_format + "'");
+    }
+    if (args.get_timings) {
+      record_timer.stop();
+      timing_data.decode_latency.record(record_timer.elapsed_time());
+    }
+    *output = obuffer.get();
+  }
+  return num_bytes;
+}
+
+// ReorderBuffer hands out blocks of records to the readers and gives the
+//   finished blocks back to the writer in their original order; a reader is
+//   held back when it gets more than 'window' blocks ahead of the writer
+class ReorderBuffer {
+public:
+  ReorderBuffer(size_t num_blocks, size_t window) : NUM_BLOCKS(num_blocks),
+      WINDOW(window), blocks(), mutex(), cond(), next_issued(0),
+      next_to_write(0), error(nullptr) { }
+  void abort(std::exception_ptr e) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (error == nullptr) {
+        error = e;
+      }
+    }
+    cond.notify_all();
+  }
+  std::exception_ptr exception() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return error;
+  }
+  bool next_block(size_t& block) {
+    std::unique_lock<std::mutex> lock(mutex);
+    cond.wait(lock, [this] { return error != nullptr || next_issued >=
+        NUM_BLOCKS || next_issued < next_to_write + WINDOW; });
+    if (error != nullptr || next_issued >= NUM_BLOCKS) {
+      return false;
+    }
+    block = next_issued++;
+    return true;
+  }
+  void put(size_t block, string data) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      blocks.emplace(block, std::move(data));
+    }
+    cond.notify_all();
+  }
+  bool take(string& data) {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (next_to_write >= NUM_BLOCKS) {
+      return false;
+    }
+    cond.wait(lock, [this] { return error != nullptr || blocks.find(
+        next_to_write) != blocks.end(); });
+    if (error != nullptr) {
+      return false;
+    }
+    auto it = blocks.find(next_to_write);
+    data = std::move(it->second);
+    blocks.erase(it);
+    ++next_to_write;
+    lock.unlock();
+    cond.notify_all();
+    return true;
+  }
+
+private:
+  const size_t NUM_BLOCKS, WINDOW;
+  unordered_map<size_t, string> blocks;
+  std::mutex mutex;
+  std::condition_variable cond;
+  size_t next_issued, next_to_write;
+  std::exception_ptr error;
+};
+
+const size_t RECORD_BLOCK_SIZE = 16;
+
+// MemoryLease holds bytes from the memory governor for as long as it lives
+class MemoryLease {
+public:
+  MemoryLease(long long min_bytes, long long max_bytes) : num_bytes(
+      memory_governor.acquire(min_bytes, max_bytes)) { }
+  MemoryLease(const MemoryLease&) = delete;
+  MemoryLease& operator=(const MemoryLease&) = delete;
+  ~MemoryLease() { memory_governor.release(num_bytes); }
+  long long bytes() const { return num_bytes; }
+
+private:
+  const long long num_bytes;
+};
+
+// object store reads are slow round trips, so keep more of them in flight
+size_t num_pipeline_readers() {
+  if (locflag == 'O') {
+    return 2;
+  }
+  return 1;
+}
+
+// the estimated memory used by the records of a file:
+//   pipeline_memory() - each block in flight holds its raw records and their
+//     output; each reader has a read buffer (up to twice the largest record),
+//     and each record worker has an output buffer
+//   sequential_memory() - a read buffer, an output buffer, and the decoded
+//     grid (taken as four times the largest record)
+long long pipeline_memory(size_t num_readers, size_t num_workers, size_t
+    window, long long max_record_length) {
+  return num_readers * 2 * max_record_length + num_workers * OBUFFER_LENGTH +
+      window * 2 * RECORD_BLOCK_SIZE * max_record_length;
+}
+
+long long sequential_memory(long long max_record_length) {
+  return 6 * max_record_length + OBUFFER_LENGTH;
+}
+
+// projected_volume() projects the volume of a whole file from the volume
+//   written so far, when a fraction 'progress' of its records has been done
+long long projected_volume(long long write_bytes, double progress) {
+  if (progress <= 0.) {
+    return write_bytes;
+  }
+  return llround(write_bytes / progress);
+}
+
+// RawBlock is a block of records as read from the input file
+struct RawBlock {
+  RawBlock() : index(0), data(), lengths() { }
+
+  size_t index;
+  string data;
+  std::vector<size_t> lengths;
+};
+
+// Pipeline connects the stages of subset_records_in_pipeline():
+//   reader(s) -> raw_blocks -> record workers -> reorder_buffer -> writer
+struct Pipeline {
+  Pipeline(size_t num_blocks, size_t window, size_t num_readers) :
+      reorder_buffer(num_blocks, window), raw_blocks(), mutex(),
+      active_readers(num_readers) { }
+
+  ReorderBuffer reorder_buffer;
+  BlockingQueue<RawBlock> raw_blocks;
+  std::mutex mutex;
+  size_t active_readers;
+};
+
+void read_blocks(const ThreadData& thread_data, const std::vector<ByteRecord>&
+    records, Pipeline& pipeline, std::shared_ptr<s3::Session> s3_session,
+    TimingData& timing_data) {
+  try {
+
+    // each reader needs its own input stream/object store session
+    InputDataSource input_data(timing_data);
+    if (locflag == 'O') {
+      input_data.initialize(s3_session, "rda-data", metautils::args.dsid + "/"
+          + thread_data.file_id);
+    } else {
+      input_data.initialize(thread_data.webhome + "/" + thread_data.file_id);
+    }
+    size_t block;
+    while (pipeline.reorder_buffer.next_block(block)) {
+      RawBlock raw_block;
+      raw_block.index = block;
+      auto end = std::min((block + 1) * RECORD_BLOCK_SIZE, records.size());
+      for (auto n = block * RECORD_BLOCK_SIZE; n < end; ++n) {
+        input_data.read(records[n].offset, records[n].length);
+        raw_block.data.append(reinterpret_cast<char *>(input_data.get()),
+            records[n].length);
+        raw_block.lengths.emplace_back(records[n].length);
+      }
+      pipeline.raw_blocks.push(std::move(raw_block));
+    }
+  } catch (...) {
+    pipeline.reorder_buffer.abort(std::current_exception());
+  }
+
+  // the last reader out lets the record workers know that there are no more
+  //   blocks coming
+  std::lock_guard<std::mutex> lock(pipeline.mutex);
+  if (--pipeline.active_readers == 0) {
+    pipeline.raw_blocks.close();
+  }
+}
+
+void subset_blocks(const ThreadData& thread_data, Pipeline& pipeline,
+    size_t num_grid_threads, TimingData& timing_data) {
+  void *msg = nullptr;
+  try {
+    if (thread_data.data_format == "WMO_GRIB1") {
+      msg = new GRIBMessage;
+    } else if (thread_data.data_format == "WMO_GRIB2") {
+      msg = new GRIB2Message;
+    }
+    unique_ptr<unsigned char[]> obuffer;
+    GRIB2Copies msg_copies;
+    RawBlock raw_block;
+    while (pipeline.raw_blocks.pop(raw_block)) {
+      string data;
+      size_t offset = 0;
+      for (const auto& length : raw_block.lengths) {
+        unsigned char *output;
+        auto num_bytes = subset_record(thread_data, msg, msg_copies,
+            reinterpret_cast<unsigned char *>(&raw_block.data[offset]), length,
+            obuffer, timing_data, num_grid_threads, &output);
+        if (num_bytes > 0) {
+          data.append(reinterpret_cast<char *>(output), num_bytes);
+        }
+        offset += length;
+      }
+      pipeline.reorder_buffer.put(raw_block.index, std::move(data));
+    }
+  } catch (...) {
+    pipeline.reorder_buffer.abort(std::current_exception());
+  }
+  if (msg != nullptr) {
+    if (thread_data.data_format == "WMO_GRIB1") {
+      delete reinterpret_cast<GRIBMessage *>(msg);
+    } else if (thread_data.data_format == "WMO_GRIB2") {
+      delete reinterpret_cast<GRIB2Message *>(msg);
+    }
+  }
+}
+
+// write_blocks() writes the subsetted blocks to 'ofs' in their original order
+void write_blocks(ThreadData& thread_data, Pipeline& pipeline, size_t
+    num_blocks, double progress_before, double progress_after, ofstream& ofs) {
+  try {
+    string data;
+    size_t num_written = 0;
+    while (pipeline.reorder_buffer.take(data)) {
+      Timer write_timer;
+      if (args.get_timings) {
+        write_timer.start();
+      }
+      ofs.write(data.c_str(), data.length());
+      thread_data.write_bytes += data.length();
+      if (args.get_timings) {
+        write_timer.stop();
+        thread_data.timing_data.write += write_timer.elapsed_time();
+      }
+
+      // project the volume of the whole file from the blocks written so far
+      ++num_written;
+      volume_governor.update(thread_data.governed_volume, projected_volume(
+          thread_data.write_bytes, progress_before + (progress_after -
+          progress_before) * num_written / num_blocks));
+      if (cancellation.is_cancelled()) {
+        pipeline.reorder_buffer.abort(std::make_exception_ptr(
+            CancelledError()));
+      }
+    }
+  } catch (...) {
+    pipeline.reorder_buffer.abort(std::current_exception());
+  }
+}
+
+// subset_records_in_pipeline() runs the records of one file through three
+//   stages that overlap with each other:
+//     read: reader tasks pull blocks of records from the input file
+//     decode/subset: 'num_record_workers' tasks subset the blocks
+//     write: the calling thread writes the subsetted blocks to 'ofs' in the
+//       original record order, so that the output is identical to a
+//       sequential run
+//   the stages run on the worker's stage pool, which is started with the
+//   first file that needs it; the number of blocks in flight is bounded, which
+//   also bounds the memory used by the pipeline; the records are the part of
+//   the file from fraction 'progress_before' to 'progress_after' of its
+//   records, for projecting the volume of the file
+void subset_records_in_pipeline(ThreadData& thread_data, const std::vector<
+    ByteRecord>& records, double progress_before, double progress_after,
+    ofstream& ofs) {
+  auto num_blocks = (records.size() + RECORD_BLOCK_SIZE - 1) /
+      RECORD_BLOCK_SIZE;
+  if (num_blocks == 0) {
+    return;
+  }
+
+  auto num_readers = std::min(num_pipeline_readers(), num_blocks);
+  auto num_workers = std::min(thread_data.num_record_workers, num_blocks);
+
+  // when memory is short, fewer blocks are kept in flight, down to one
+  long long max_record_length = 0;
+  for (const auto& record : records) {
+    max_record_length = std::max(max_record_length, static_cast<long long>(
+        record.length));
+  }
+  auto window = (num_readers + num_workers) * 2;
+  MemoryLease lease(pipeline_memory(num_readers, num_workers, 1,
+      max_record_length), pipeline_memory(num_readers, num_workers, window,
+      max_record_length));
+  auto block_memory = pipeline_memory(0, 0, 1, max_record_length);
+  if (block_memory > 0) {
+    window = std::max(std::min(window, static_cast<size_t>((lease.bytes() -
+        pipeline_memory(num_readers, num_workers, 0, max_record_length)) /
+        block_memory)), static_cast<size_t>(1));
+  }
+  if (thread_data.stage_pool == nullptr) {
+
+    // one thread for each reader and record worker; the writer is the calling
+    //   thread
+    thread_data.stage_pool.reset(new TaskPool(num_pipeline_readers() +
+        thread_data.num_record_workers));
+  }
+  if (locflag == 'O') {
+
+    // the readers' object store sessions are opened once for the worker
+    if (thread_data.reader_s3_sessions.empty()) {
+      thread_data.reader_s3_sessions.emplace_back(thread_data.s3_session);
+    }
+    while (thread_data.reader_s3_sessions.size() < num_readers) {
+      thread_data.reader_s3_sessions.emplace_back(std::make_shared<s3::
+          Session>(thread_data.obj_store.host, thread_data.obj_store.
+          access_key, thread_data.obj_store.secret_key, thread_data.obj_store.
+          region, thread_data.obj_store.terminal));
+    }
+  }
+  Pipeline pipeline(num_blocks, window, num_readers);
+  std::vector<TimingData> reader_timing_data(num_readers),
+      worker_timing_data(num_workers);
+  std::vector<std::function<void()>> stages;
+  stages.emplace_back([&] { write_blocks(thread_data, pipeline, num_blocks,
+      progress_before, progress_after, ofs); });
+  for (size_t n = 0; n < num_readers; ++n) {
+    auto s3_session = locflag == 'O' ? thread_data.reader_s3_sessions[n] :
+        nullptr;
+    stages.emplace_back([&, n, s3_session] { read_blocks(thread_data, records,
+        pipeline, s3_session, reader_timing_data[n]); });
+  }
+
+  // when there are more record workers than blocks, the spare ones go to the
+  //   grids within each message
+  auto num_grid_threads = std::max(thread_data.num_record_workers / num_workers,
+      static_cast<size_t>(1));
+  for (size_t n = 0; n < num_workers; ++n) {
+    stages.emplace_back([&, n] { subset_blocks(thread_data, pipeline,
+        num_grid_threads, worker_timing_data[n]); });
+  }
+  thread_data.stage_pool->run(stages);
+  for (const auto& t : reader_timing_data) {
+    thread_data.timing_data.add(t);
+  }
+  for (const auto& t : worker_timing_data) {
+    thread_data.timing_data.add(t);
+  }
+  if (pipeline.reorder_buffer.exception() != nullptr) {
+    std::rethrow_exception(pipeline.reorder_buffer.exception());
+  }
+}
+
 void build_subset(ThreadData& thread_data, GridData& grid_data, const
     NCTime& nc_time, SpatialBitmap& spatial_bitmap, int num_values_in_subset,
-    LocalQuery& byte_query, unique_ptr<unordered_set<string>>& nts_table,
-    OutputStream& outs, bool is_multi) {
+    const FileInventory& inventory, ConnectionPool& metadb_pool, unique_ptr<
+    unordered_set<string>>& nts_table, OutputStream& outs, bool is_multi) {
+  InventoryCursor cursor(inventory, metadb_pool, InventoryFile(thread_data.
+      file_code, thread_data.data_format), thread_data.uConditions);
   if (args.is_test) {
 
     // if this is a test run, report the number of grids that would need to be
-    //   accessed, and return
-    thread_data.timing_data.num_reads = byte_query.num_rows();
+    //   accessed, and return; the volume of the grids is the projected volume
+    //   of the subset
+    thread_data.timing_data.num_reads = 0;
+    long long max_record_length = 0;
+    while (cursor.next()) {
+      thread_data.timing_data.num_reads += cursor.records().size();
+      for (const auto& record : cursor.records()) {
+        thread_data.write_bytes += record.length;
+        max_record_length = std::max(max_record_length, static_cast<long
+            long>(record.length));
+      }
+    }
+
+    // note the memory that one thread would need for these records, for
+    //   sizing a batch job
+    memory_governor.note_demand(std::max(pipeline_memory(1, 1, 2,
+        max_record_length), sequential_memory(max_record_length)));
     return;
   }
   const string THIS_FUNC = __func__;
@@ -611,239 +1058,200 @@ void build_subset(ThreadData& thread_data, GridData& grid_data, const
   } else if (thread_data.data_format == "WMO_GRIB2") {
     msg = new GRIB2Message;
   }
+  GRIB2Copies msg_copies;
   thread_data.fcount = 0;
   thread_data.write_bytes = 0;
+  if (request_values.ofmt.empty() && !request_values.ststep && outs.ofs.
+      is_open()) {
 
-  // initialize the input data source
-  InputDataSource input_data;
-  if (locflag == 'O') {
-    input_data.initialize(thread_data.s3_session, "rda-data", metautils::args.
-        dsid + "/" + thread_data.file_id);
+    // native-format output goes through the read/subset/write pipeline, one
+    //   block of records at a time
+    auto progress = 0.;
+    while (cursor.next()) {
+      auto& records = cursor.records();
+      if (request_values.topt_mo[0] && !records.empty() && thread_data.
+          insert_filenames.empty()) {
+        thread_data.insert_filenames.emplace_back(thread_data.filename.substr(
+            1));
+        thread_data.wget_filenames.emplace_back(thread_data.filename.substr(1)
+            + request_values.ancillary.compression);
+      }
+      subset_records_in_pipeline(thread_data, records, progress, cursor.
+          progress(), outs.ofs);
+      progress = cursor.progress();
+    }
   } else {
-    input_data.initialize(thread_data.webhome + "/" + thread_data.file_id);
-  }
-  for (const auto& row : byte_query) {
-    if (!request_values.topt_mo[0] || request_values.topt_mo[stoi(row[2].substr(
-        4, 2))]) {
-      if (!request_values.ofmt.empty()) {
-
-        // convert to a different data format
-        if (to_lower(request_values.ofmt) == "netcdf") {
-          build_netcdf_subset(input_data, stoll(row[0]), stoi(row[1]), msg,
-              outs, grid_data, thread_data, is_multi);
-        } else if (to_lower(request_values.ofmt) == "csv") {
-          build_csv_subset(input_data, stoll(row[0]), stoi(row[1]), msg, &glats,
-              outs.ofs, thread_data);
-        } else {
-          throw runtime_error(THIS_FUNC + "(): unable to convert to '" +
-              request_values.ofmt + "'");
-        }
-      } else {
 
-        // no format conversion; subset is same as native data format
-        if (request_values.ststep) {
-          if (row[2] != last_valid_date && outs.ofs.is_open()) {
-            outs.ofs.close();
-            system(("mv " + args.download_directory + "/" + stsfil + TMP_EXT +
-                " " + args.download_directory + "/" + stsfil).c_str());
-            ++thread_data.fcount;
+    // initialize the input data source; the pipeline's readers have their own
+    InputDataSource input_data(thread_data.timing_data);
+    if (locflag == 'O') {
+      input_data.initialize(thread_data.s3_session, "rda-data", metautils::
+          args.dsid + "/" + thread_data.file_id);
+    } else {
+      input_data.initialize(thread_data.webhome + "/" + thread_data.file_id);
+    }
+    auto progress = 0.;
+    while (cursor.next()) {
+      auto& records = cursor.records();
+      long long max_record_length = 0;
+      for (const auto& record : records) {
+        max_record_length = std::max(max_record_length, static_cast<long long>(
+            record.length));
+      }
+      MemoryLease lease(sequential_memory(max_record_length), sequential_memory(
+          max_record_length));
+      size_t num_rows_done = 0;
+      for (const auto& record : records) {
+        throw_if_cancelled();
+        ++num_rows_done;
+        if (!request_values.ofmt.empty()) {
+
+          // convert to a different data format
+          if (to_lower(request_values.ofmt) == "netcdf") {
+            build_netcdf_subset(input_data, record.offset, record.length, msg,
+                outs, grid_data, thread_data, is_multi);
+          } else if (to_lower(request_values.ofmt) == "csv") {
+            build_csv_subset(input_data, record.offset, record.length, msg,
+                &glats, outs.ofs, thread_data);
+          } else {
+            throw runtime_error(THIS_FUNC + "(): unable to convert to '" +
+                request_values.ofmt + "'");
           }
-          stsfil = row[2] + "." + thread_data.filename.substr(1);
-          if (!outs.ofs.is_open()) {
-            if (nts_table->find(stsfil) == nts_table->end()) {
-              nts_table->emplace(stsfil);
-              thread_data.insert_filenames.emplace_back(stsfil);
-              thread_data.wget_filenames.emplace_back(stsfil +
-                  request_values.ancillary.compression);
+        } else {
+
+          // no format conversion; subset is same as native data format
+          if (request_values.ststep) {
+            if (record.valid_date != last_valid_date && outs.ofs.is_open()) {
+              outs.ofs.close();
+              move_file(args.download_directory + "/" + stsfil + TMP_EXT, args.
+                  download_directory + "/" + stsfil);
+              ++thread_data.fcount;
             }
-            struct stat buf;
-            if (stat((args.download_directory + "/" + stsfil).c_str(), &buf) !=
-                0) {
-              outs.ofs.open((args.download_directory + "/" + stsfil + TMP_EXT)
-                  .c_str());
-              if (!outs.ofs.is_open()) {
-                throw runtime_error("Error opening " + args.download_directory +
-                    "/" + stsfil + " for output");
-              } else {
-                if (nts_table->find(stsfil) == nts_table->end()) {
-                  nts_table->emplace(stsfil);
-                  ++thread_data.fcount;
-                  thread_data.insert_filenames.emplace_back(stsfil);
-                  thread_data.wget_filenames.emplace_back(stsfil +
-                      request_values.ancillary.compression);
-                }
+            stsfil = record.valid_date + "." + thread_data.filename.substr(1);
+            if (!outs.ofs.is_open()) {
+              if (nts_table->find(stsfil) == nts_table->end()) {
+                nts_table->emplace(stsfil);
+                thread_data.insert_filenames.emplace_back(stsfil);
+                thread_data.wget_filenames.emplace_back(stsfil +
+                    request_values.ancillary.compression);
               }
-            }
-          }
-          last_valid_date = row[2];
-        } else if (request_values.topt_mo[0] && thread_data.insert_filenames
-            .size() == 0) {
-          thread_data.insert_filenames.emplace_back(
-              thread_data.filename.substr(1));
-          thread_data.wget_filenames.emplace_back(thread_data.filename.substr(
-              1) + request_values.ancillary.compression);
-        }
-        if (outs.ofs.is_open()) {
-          auto num_bytes = stoi(row[1]);
-          input_data.read(stoll(row[0]), stoi(row[1]));
-          auto is_spatial_subset = false;
-          if (request_values.nlat < 9999. && request_values.elon < 9999. &&
-              request_values.slat > -9999. && request_values.wlon > -9999.) {
-            if (thread_data.data_format == "WMO_GRIB1") {
-              reinterpret_cast<GRIBMessage *>(msg)->fill(input_data.get(),
-                  false);
-              auto grid = reinterpret_cast<GRIBMessage *>(msg)->grid(0);
-              if (is_selected_parameter(thread_data, grid)) {
-                GRIBMessage smsg;
-                smsg.initialize(1, nullptr, 0, true, true);
-                GRIBGrid sgrid;
-                grid->set_path_to_gaussian_latitude_data(args.SHARE_DIRECTORY +
-                    "/GRIB");
-                sgrid = create_subset_grid(*(reinterpret_cast<GRIBGrid *>(
-                    grid)), request_values.slat, request_values.nlat,
-                    request_values.wlon, request_values.elon);
-                if (sgrid.is_filled()) {
-                  smsg.append_grid(&sgrid);
-                  if (thread_data.obuffer == nullptr) {
-                    thread_data.obuffer.reset(new unsigned char[
-                        OBUFFER_LENGTH]);
-                  }
-                  num_bytes = smsg.copy_to_buffer(thread_data.obuffer.get(),
-                      OBUFFER_LENGTH);
+              struct stat buf;
+              if (stat((args.download_directory + "/" + stsfil).c_str(), &buf)
+                  != 0) {
+                outs.ofs.open((args.download_directory + "/" + stsfil + TMP_EXT)
+                    .c_str());
+                if (!outs.ofs.is_open()) {
+                  throw runtime_error("Error opening " + args.
+                      download_directory + "/" + stsfil + " for output");
                 } else {
-                  num_bytes = 0;
-                }
-              }
-            } else if (thread_data.data_format == "WMO_GRIB2") {
-              Timer grib2u_timer;
-              if (args.get_timings) {
-                grib2u_timer.start();
-              }
-              reinterpret_cast<GRIB2Message *>(msg)->fill(input_data.get(),
-                  false);
-              Timer grib2c_timer;
-              if (args.get_timings) {
-                grib2u_timer.stop();
-                thread_data.timing_data.grib2u += grib2u_timer.elapsed_time();
-                grib2c_timer.start();
-              }
-              GRIB2Message smsg2;
-              smsg2.initialize(2, nullptr, 0, true, true);
-              for (size_t n = 0; n < reinterpret_cast<GRIB2Message *>(msg)->
-                  number_of_grids(); ++n) {
-                auto grid = reinterpret_cast<GRIB2Message *>(msg)->grid(n);
-                grid->set_path_to_gaussian_latitude_data(args.SHARE_DIRECTORY +
-                    "/GRIB");
-                if (is_selected_parameter(thread_data, grid)) {
-                  GRIB2Grid sgrid2;
-                  sgrid2 = (reinterpret_cast<GRIB2Grid *>(grid))->
-                      create_subset(request_values.slat, request_values.nlat, 1,
-                      request_values.wlon, request_values.elon, 1);
-                  switch (sgrid2.data_representation()) {
-                    case 2:
-                    case 3: {
-                      sgrid2.set_data_representation(0);
-                      break;
-                    }
+                  if (nts_table->find(stsfil) == nts_table->end()) {
+                    nts_table->emplace(stsfil);
+                    ++thread_data.fcount;
+                    thread_data.insert_filenames.emplace_back(stsfil);
+                    thread_data.wget_filenames.emplace_back(stsfil +
+                        request_values.ancillary.compression);
                   }
-                  smsg2.append_grid(&sgrid2);
                 }
               }
-              if (thread_data.obuffer == nullptr) {
-                thread_data.obuffer.reset(new unsigned char[OBUFFER_LENGTH]);
-              }
-              num_bytes = smsg2.copy_to_buffer(thread_data.obuffer.get(),
-                  OBUFFER_LENGTH);
-              if (args.get_timings) {
-                grib2c_timer.stop();
-                thread_data.timing_data.grib2c += grib2c_timer.elapsed_time();
-              }
-            } else {
-              throw runtime_error(THIS_FUNC + "(): unable to create subset for "
-                  "format '" + thread_data.data_format + "'");
             }
-            is_spatial_subset = true;
-          }
-          Timer write_timer;
-          if (args.get_timings) {
-            write_timer.start();
+            last_valid_date = record.valid_date;
+          } else if (request_values.topt_mo[0] && thread_data.insert_filenames
+              .size() == 0) {
+            thread_data.insert_filenames.emplace_back(
+                thread_data.filename.substr(1));
+            thread_data.wget_filenames.emplace_back(thread_data.filename.substr(
+                1) + request_values.ancillary.compression);
           }
-          if (is_spatial_subset) {
+          if (outs.ofs.is_open()) {
+            input_data.read(record.offset, record.length);
+            unsigned char *output;
+            auto num_bytes = subset_record(thread_data, msg, msg_copies,
+                input_data.get(), record.length, thread_data.obuffer,
+                thread_data.timing_data, thread_data.num_record_workers,
+                &output);
+            Timer write_timer;
+            if (args.get_timings) {
+              write_timer.start();
+            }
             if (num_bytes > 0) {
-              outs.ofs.write(reinterpret_cast<char *>(thread_data.obuffer
-                  .get()), num_bytes);
+              outs.ofs.write(reinterpret_cast<char *>(output), num_bytes);
             }
-          } else {
-            outs.ofs.write(reinterpret_cast<char *>(input_data.get()),
-                num_bytes);
-          }
-          thread_data.write_bytes += num_bytes;
-          if (args.get_timings) {
-            write_timer.stop();
-            thread_data.timing_data.write += write_timer.elapsed_time();
-          }
-        } else if (outs.onc.is_open()) {
-          if (request_values.parameters.size() > 1) {
-            throw runtime_error(THIS_FUNC + "(): found more than one parameter "
-                "- can't continue");
-          }
-          auto tval = DateTime(stoll(row[2]) * 100).seconds_since(nc_time.base);
-          if (nc_time.units == "hours") {
-            tval /= 3600.;
-          } else if (nc_time.units == "days") {
-            tval /= 86400.;
-          } else {
-            throw runtime_error(THIS_FUNC + "(): can't handle nc time units of "
-                "'" + nc_time.units + "'");
-          }
-          VariableData time_data;
-          if (time_data.size() == 0) {
-            time_data.resize(1, nc_time.nc_type);
-          }
-          time_data.set(0, tval);
-          outs.onc.add_record_data(time_data);
-          input_data.read(stoll(row[0]), stoi(row[1]));
-          Timer nc_timer;
-          if (args.get_timings) {
-            nc_timer.start();
-          }
-          if (!row[3].empty()) {
-            VariableData var_data;
-            if (var_data.size() == 0) {
-              var_data.resize(num_values_in_subset,
-                  static_cast<NCType>(stoi(row[3])));
+            thread_data.write_bytes += num_bytes;
+            if (args.get_timings) {
+              write_timer.stop();
+              thread_data.timing_data.write += write_timer.elapsed_time();
             }
-            auto m = 0;
-            for (int n = 0; n < spatial_bitmap.length(); ++n) {
-              if (spatial_bitmap[n] == 1) {
-                switch (static_cast<NCType>(stoi(row[3]))) {
-                  case NCType::FLOAT: {
-                    union {
-                      int i;
-                      float f;
-                    } b4_data;
-                    bits::get(&(input_data.get())[n * 4], b4_data.i, 0, 32);
-                    var_data.set(m++, b4_data.f);
-                    break;
-                  }
-                  default: {
-                    throw runtime_error(THIS_FUNC + "(): can't handle nc "
-                        "variable type " + row[3]);
+            volume_governor.update(thread_data.governed_volume,
+                projected_volume(thread_data.write_bytes, progress + (cursor.
+                progress() - progress) * num_rows_done / records.size()));
+          } else if (outs.onc.is_open()) {
+            if (request_values.parameters.size() > 1) {
+              throw runtime_error(THIS_FUNC + "(): found more than one "
+                  "parameter - can't continue");
+            }
+            auto tval = DateTime(stoll(record.valid_date) * 100).seconds_since(
+                nc_time.base);
+            if (nc_time.units == "hours") {
+              tval /= 3600.;
+            } else if (nc_time.units == "days") {
+              tval /= 86400.;
+            } else {
+              throw runtime_error(THIS_FUNC + "(): can't handle nc time units "
+                  "of '" + nc_time.units + "'");
+            }
+            VariableData time_data;
+            if (time_data.size() == 0) {
+              time_data.resize(1, nc_time.nc_type);
+            }
+            time_data.set(0, tval);
+            outs.onc.add_record_data(time_data);
+            input_data.read(record.offset, record.length);
+            Timer nc_timer;
+            if (args.get_timings) {
+              nc_timer.start();
+            }
+            if (!record.process.empty()) {
+              VariableData var_data;
+              if (var_data.size() == 0) {
+                var_data.resize(num_values_in_subset,
+                    static_cast<NCType>(stoi(record.process)));
+              }
+              auto m = 0;
+              for (int n = 0; n < spatial_bitmap.length(); ++n) {
+                if (spatial_bitmap[n] == 1) {
+                  switch (static_cast<NCType>(stoi(record.process))) {
+                    case NCType::FLOAT: {
+                      union {
+                        int i;
+                        float f;
+                      } b4_data;
+                      bits::get(&(input_data.get())[n * 4], b4_data.i, 0, 32);
+                      var_data.set(m++, b4_data.f);
+                      break;
+                    }
+                    default: {
+                      throw runtime_error(THIS_FUNC + "(): can't handle nc "
+                          "variable type " + record.process);
+                    }
                   }
                 }
               }
+              outs.onc.add_record_data(var_data);
+              if (args.get_timings) {
+                nc_timer.stop();
+                thread_data.timing_data.nc += nc_timer.elapsed_time();
+              }
+            } else {
+              throw runtime_error(THIS_FUNC + "(): incomplete inventory "
+                  "information - can't continue");
             }
-            outs.onc.add_record_data(var_data);
-            if (args.get_timings) {
-              nc_timer.stop();
-              thread_data.timing_data.nc += nc_timer.elapsed_time();
-            }
-          } else {
-            throw runtime_error(THIS_FUNC + "(): incomplete inventory "
-                "information - can't continue");
           }
         }
       }
+
+      // the output buffer was part of the memory lease, so don't keep it
+      thread_data.obuffer.reset();
+      progress = cursor.progress();
     }
   }
   if (msg != nullptr) {
@@ -872,7 +1280,7 @@ void build_subset(ThreadData& thread_data, GridData& grid_data, const
       thread_data.filename = "";
       thread_data.f_attach = "";
     } else {
-      system(("mv " + temp_file + " " + output_file).c_str());
+      move_file(temp_file, output_file);
       thread_data.write_bytes += buf.st_size;
       ++thread_data.fcount;
     }
@@ -887,25 +1295,25 @@ void build_subset(ThreadData& thread_data, GridData& grid_data, const
       thread_data.filename = "";
       thread_data.f_attach = "";
     } else if (thread_data.insert_filenames.size() > 0) {
-      system(("mv " + args.download_directory + "/" +
-          thread_data.insert_filenames.back() + TMP_EXT + " " +
-          args.download_directory + "/" +
-          thread_data.insert_filenames.back()).c_str());
+      move_file(args.download_directory + "/" + thread_data.insert_filenames.
+          back() + TMP_EXT, args.download_directory + "/" + thread_data.
+          insert_filenames.back());
       ++thread_data.fcount;
     } else {
       if (regex_search(thread_data.data_format, regex("grib2", regex::icase)) &&
           regex_search(request_values.ofmt, regex("netcdf", regex::icase)) &&
           !regex_search(thread_data.filename, NC_END)) {
         sort_to_nc_order(temp_file, output_file + ".sorted");
-        system(("mv " + output_file + ".sorted " + temp_file).c_str());
+        move_file(output_file + ".sorted", temp_file);
       }
-      system(("mv " + temp_file + " " + output_file).c_str());
+      move_file(temp_file, output_file);
       ++thread_data.fcount;
     }
   }
 }
 
-void build_file(ThreadData& thread_data, bool& is_temporal_subset) {
+void build_file(ThreadData& thread_data, InventoryPrefetcher& prefetcher,
+    ConnectionPool& metadb_pool) {
 
   // initializations
   Timer thread_timer;
@@ -918,6 +1326,9 @@ void build_file(ThreadData& thread_data, bool& is_temporal_subset) {
   thread_data.f_attach = "";
   thread_data.insert_filenames.clear();
   thread_data.wget_filenames.clear();
+  thread_data.write_bytes = 0;
+  thread_data.governed_volume = 0;
+  throw_if_cancelled();
   if (!request_values.ofmt.empty()) {
     thread_data.output_format = request_values.ofmt;
   } else {
@@ -930,41 +1341,24 @@ void build_file(ThreadData& thread_data, bool& is_temporal_subset) {
       thread_data.multi_set->end());
   if (args.is_test || !file_exists(thread_data, nts_table, outs, is_multi)) {
 
-    // connect to the database and submit the main byte query
-    Server srv(metautils::directives.metadb_config, 300);
-    if (!srv) {
-      throw runtime_error("Error: build_file() unable to connect to metadata "
-          "server: '" + srv.error() + "'");
-    }
-
     // if this is a test run or the file doesn't already exist:
     //   need to process byte data for a test run
     //   need to build the file for an actual subset run
-    // build the necessary database queries
-    LocalQuery byte_query, byte_query_no_dates, query_count_files;
-    build_queries(srv, thread_data, byte_query, byte_query_no_dates,
-        query_count_files);
-
-    if (byte_query.submit(srv) < 0) {
-      throw runtime_error("Error: " + byte_query.error() + "\nQuery: " +
-          byte_query.show());
-    }
-
-    // check for temporal subsetting
-    if (!args.is_test && !is_temporal_subset) {
-      if (byte_query_no_dates.submit(srv) < 0) {
-        throw runtime_error("Error: " + byte_query_no_dates.error() + "\n"
-            "Query: " + byte_query_no_dates.show());
-      }
-      if (byte_query.num_rows() < byte_query_no_dates.num_rows()) {
-        is_temporal_subset = true;
-      }
+    // use the inventory from the prefetcher if it has already queried it;
+    //   otherwise, query it here
+    auto inventory = prefetcher.take(thread_data.file_code);
+    if (inventory == nullptr) {
+      std::vector<FileInventory> inventories;
+      query_inventories(*metadb_pool.get(), { InventoryFile(thread_data.
+          file_code, thread_data.data_format) }, thread_data.uConditions,
+          thread_data.uConditions_no_dates, inventories);
+      inventory.reset(new FileInventory(std::move(inventories.front())));
     }
     NCTime nc_time;
     SpatialBitmap spatial_bitmap;
     int num_values_in_subset;
     if (!linked_to_full_file(thread_data, outs, nc_time, spatial_bitmap,
-        num_values_in_subset, srv, query_count_files, byte_query.num_rows())) {
+        num_values_in_subset, *inventory)) {
 
       // if the request does not ask for the full file, proceed with processing
       //   of the subset
@@ -974,7 +1368,8 @@ void build_file(ThreadData& thread_data, bool& is_temporal_subset) {
       grid_data.subset_definition.longitude.east = request_values.elon;
       grid_data.path_to_gauslat_lists = args.SHARE_DIRECTORY + "/GRIB";
       build_subset(thread_data, grid_data, nc_time, spatial_bitmap,
-          num_values_in_subset, byte_query, nts_table, outs, is_multi);
+          num_values_in_subset, *inventory, metadb_pool, nts_table, outs,
+          is_multi);
     } else {
       thread_data.fcount = 1;
     }
@@ -984,45 +1379,157 @@ void build_file(ThreadData& thread_data, bool& is_temporal_subset) {
       // convert the data format, if necessary
       do_conversion(thread_data);
     }
-
-    // disconnect from the database
-    srv.disconnect();
+  } else {
+    prefetcher.skip(thread_data.file_code);
   }
-  if (!thread_data.insert_filenames.empty()) {
 
-    // update wfrqst with any file names reported by the thread
-    Server srv(metautils::directives.rdadb_config, 300);
-    if (!srv) {
-      throw runtime_error("build_file(): unable to connect to RDADB server: '" +
-          srv.error() + "'");
-    }
-    for (const auto& fname : thread_data.insert_filenames) {
-      insert_into_wfrqst(srv, args.rqst_index, fname, thread_data.output_format,
-          thread_data.filelist_display_order);
-    }
-    srv.disconnect();
-  }
+  // the projection for this file is replaced by its actual volume, and if that
+  //   puts the request over the cap, none of its files get registered
+  volume_governor.update(thread_data.governed_volume, thread_data.write_bytes);
+  throw_if_cancelled();
   if (args.get_timings) {
 
     // record timings, if requested
     thread_timer.stop();
     thread_data.timing_data.thread = thread_timer.elapsed_time();
   }
+}
+
+string output_filename(string file_id, string data_format) {
+  auto idx = file_id.rfind("/");
+  string filename;
+  if (idx != string::npos) {
+    filename = file_id.substr(idx);
+  } else {
+    filename = "/" + file_id;
+  }
+  replace_all(filename, ".tar", "");
+  if (data_format == "WMO_GRIB2") {
+    if (!regex_search(filename, regex(".grb2")) && !regex_search(filename,
+        regex(".grib2")))
+      filename += ".grb2";
+  }
+  return filename;
+}
 
-  // mark the thread as completed
-  thread_data.has_finished = true;
+// remove_partial_output() removes the temporary files of the file that a
+//   worker was building - its output file and any single-timestep files - and
+//   nothing else, since other runs may be writing into the same directory
+void remove_partial_output(const ThreadData& thread_data) {
+  if (args.is_test || thread_data.filename.empty()) {
+    return;
+  }
+  std::remove((args.download_directory + thread_data.filename + TMP_EXT).
+      c_str());
+  for (const auto& fname : thread_data.insert_filenames) {
+    std::remove((args.download_directory + "/" + fname + TMP_EXT).c_str());
+  }
+}
+
+void process_files(ThreadData& thread_data, BlockingQueue<FileTask>& tasks,
+    BlockingQueue<FileResult>& results, InventoryPrefetcher& prefetcher,
+    ConnectionPool& metadb_pool, WfrqstRegistrar& registrar) {
+  if (thread_data.num_record_workers > 1) {
+
+    // the grids of a GRIB2 message are shared out among the record workers;
+    //   the calling thread is one of them
+    thread_data.grid_pool.reset(new TaskPool(thread_data.num_record_workers -
+        1));
+  }
+  FileTask task;
+  while (tasks.pop(task)) {
+    FileResult result;
+    result.filelist_display_order = task.filelist_display_order;
+    for (size_t attempt = 0; ; ++attempt) {
+      try {
+
+        // every attempt starts over from the task
+        long long data_size;
+        tie(thread_data.file_code, thread_data.file_id, data_size, thread_data.
+            data_format, thread_data.data_format_code) = task.input_file;
+        thread_data.filename = output_filename(thread_data.file_id,
+            thread_data.data_format);
+        thread_data.size_input = data_size;
+        thread_data.filelist_display_order = task.filelist_display_order;
+        build_file(thread_data, prefetcher, metadb_pool);
+        result.wget_filenames.swap(thread_data.wget_filenames);
+        result.fcount = thread_data.fcount;
+        result.write_bytes = thread_data.write_bytes;
+        result.timing_data = thread_data.timing_data;
+        result.failure.clear();
+        break;
+      } catch (const CancelledError&) {
+        result.error = std::current_exception();
+        remove_partial_output(thread_data);
+        break;
+      } catch (const std::exception& e) {
+        result.failure = thread_data.file_id + ": " + e.what();
+      } catch (...) {
+        result.failure = thread_data.file_id + ": unknown error";
+      }
+
+      // the failed attempt no longer counts toward the request volume
+      volume_governor.update(thread_data.governed_volume, 0);
+      thread_data.timing_data.reset();
+      if (attempt >= thread_data.file_retries || cancellation.is_cancelled()) {
+        remove_partial_output(thread_data);
+        break;
+      }
+
+      // back off before trying again: 5, 10, 20, ... seconds, up to a minute;
+      //   a cancelled run doesn't wait
+      cancellation.wait_for(std::chrono::seconds(std::min(5 << std::min(
+          attempt, static_cast<size_t>(4)), 60)));
+    }
+
+    // the files of a file that was built are registered in wfrqst; an error in
+    //   registering them is an error in the request, not in the file
+    if (result.error == nullptr && result.failure.empty()) {
+      try {
+        for (const auto& fname : thread_data.insert_filenames) {
+          registrar.add(fname, thread_data.output_format, thread_data.
+              filelist_display_order);
+        }
+      } catch (...) {
+        result.error = std::current_exception();
+      }
+    }
+    thread_data.timing_data.reset();
+    results.push(std::move(result));
+  }
+
+  // the worker's pipeline and grid threads end with the worker
+  thread_data.stage_pool = nullptr;
+  thread_data.grid_pool = nullptr;
+}
+
+// report_failed_files() lists the input files that could not be built, in
+//   display order, on stderr and in .failed_files in the request directory (a
+//   shard has its own list, for the merge run)
+void report_failed_files(const std::map<size_t, string>& failed_files) {
+  std::ofstream ofs;
+  if (!args.is_test) {
+    ofs.open(failed_files_filename().c_str());
+  }
+  cerr << failed_files.size() << " input file(s) failed:" << endl;
+  for (const auto& e : failed_files) {
+    cerr << "  " << e.first << " " << e.second << endl;
+    if (ofs.is_open()) {
+      ofs << e.first << " " << e.second << endl;
+    }
+  }
 }
 
 void build_subset_files(const std::vector<InputFile>& input_files,
-    const unordered_set<string>& multiple_parameter_files_code_set,
-    ThreadData *thread_data, std::vector<string>& wget_list, long long&
-    size_input, size_t& fcount, bool& is_temporal_subset) {
+    const std::vector<size_t>& display_orders, ThreadData *thread_data, std::
+    vector<string>& wget_list, long long& size_input, size_t& fcount, bool&
+    is_temporal_subset) {
   fcount = 0;
   auto num_threads_to_create = args.num_threads;
   if (args.is_test) {
 
     // force test runs to only use two threads
-    num_threads_to_create = 2;
+    num_threads_to_create = std::min(args.num_threads, static_cast<size_t>(2));
   } else {
 
     // if not a test run, remove any core files that might have been left from a
@@ -1030,101 +1537,129 @@ void build_subset_files(const std::vector<InputFile>& input_files,
     stringstream oss, ess;
     mysystem2("/bin/rm -f " + args.download_directory + "/core*", oss, ess);
   }
-  thread thread_list[num_threads_to_create];
-  size_t num_created_threads = 0;
-  auto thread_index = 0;
-  auto filelist_display_order = 1;
+  num_threads_to_create = std::min(num_threads_to_create, input_files.size());
+
+  // queue up all of the files, most expensive first, and start the worker pool;
+  //   each worker owns one ThreadData slot for the life of the run
+  BlockingQueue<FileTask> tasks;
+  BlockingQueue<FileResult> results;
+  std::vector<FileTask> scheduled_tasks;
   size_input = 0;
-  long long write_bytes = 0;
-  for (const auto& input_file : input_files) {
-    while (num_created_threads == num_threads_to_create) {
-      for (size_t n = 0; n < num_created_threads; ++n) {
-        if (thread_data[n].has_started && thread_data[n].has_finished) {
-          thread_list[n].join();
-          thread_data[n].has_started = false;
-          for (const auto& fname : thread_data[n].wget_filenames) {
-            wget_list.emplace_back(fname);
-          }
-          fcount += thread_data[n].fcount;
-          if (args.is_test || args.get_timings) {
-            timing_data.add(thread_data[n].timing_data);
-          }
-          if (args.is_test) {
-            write_bytes += thread_data[n].timing_data.read_bytes;
-          } else {
-            write_bytes += thread_data[n].write_bytes;
-          }
-          if (!args.ignore_volume && write_bytes > 900000000000) {
-// join all remaining running threads before terminating
-for (size_t m = 0; m < num_created_threads; ++m) {
-if (thread_data[m].has_started) {
-thread_list[m].join();
-}
-}
-              terminate("Error: requested volume is too large", "Error: "
-                  "request volume too large");
-          }
-          thread_index = n;
-          thread_data[n].timing_data.reset();
-          --num_created_threads;
-          break;
-        }
-      }
+  for (const auto& idx : schedule_input_files(input_files,
+      num_threads_to_create)) {
+
+    // the display order of a file stays that of the database order
+    scheduled_tasks.emplace_back(input_files[idx], display_orders[idx]);
+    tasks.push(scheduled_tasks.back());
+    size_input += std::get<2>(input_files[idx]);
+  }
+  tasks.close();
+
+  // the database connections are shared by the workers, the prefetcher, and
+  //   the request watcher, and are reused from file to file
+  ConnectionPool metadb_pool(metautils::directives.metadb_config,
+      num_threads_to_create + 1, 300);
+  ConnectionPool rdadb_pool(metautils::directives.rdadb_config,
+      num_threads_to_create + 1, 300);
+
+  // whether the request subsets the files in time is decided once, by counts
+  //   over all of the files, rather than by each worker for its own file
+  if (!args.is_test) {
+    is_temporal_subset = has_temporal_subset(*metadb_pool.get(), input_files,
+        thread_data[0].uConditions, thread_data[0].uConditions_no_dates);
+  }
+
+  // query the inventories of the next files ahead of the workers; the window
+  //   is wide enough that each batch query covers a good number of files
+  InventoryPrefetcher prefetcher(scheduled_tasks, std::max(
+      num_threads_to_create * 4, static_cast<size_t>(32)),
+      thread_data[0].uConditions, thread_data[0].uConditions_no_dates,
+      metadb_pool);
+
+  // the output files are registered in wfrqst in batches
+  WfrqstRegistrar registrar(rdadb_pool, args.rqst_index);
+
+  // stop the workers if the request is purged or withdrawn while they run
+  RequestWatcher request_watcher(rdadb_pool);
+  std::vector<thread> workers;
+  for (size_t n = 0; n < num_threads_to_create; ++n) {
+
+    // when there are fewer files than threads, the idle threads are shared out
+    //   as record workers within each file
+    thread_data[n].num_record_workers = args.num_threads /
+        num_threads_to_create;
+    workers.emplace_back(process_files, ref(thread_data[n]), ref(tasks),
+        ref(results), ref(prefetcher), ref(metadb_pool), ref(registrar));
+  }
+
+  // aggregate the results as they arrive; the volume cap is enforced by the
+  //   workers as they write, through the volume governor
+  std::exception_ptr error = nullptr;
+  std::map<size_t, TimingData> file_timing_data;
+  std::map<size_t, string> failed_files;
+  for (size_t n = 0; n < input_files.size(); ++n) {
+    FileResult result;
+    results.pop(result);
+    if (result.error != nullptr) {
+      error = result.error;
+      break;
     }
-    string file_code, file_id, data_format, data_format_code;
-    long long data_size;
-    tie(file_code, file_id, data_size, data_format, data_format_code) =
-        input_file;
-    auto idx = file_id.rfind("/");
-    string filename;
-    if (idx != string::npos) {
-      filename = file_id.substr(idx);
-    } else {
-      filename = "/" + file_id;
+    if (!result.failure.empty()) {
+
+      // a file that failed all of its retries is reported at the end, and the
+      //   rest of the request goes on
+      failed_files.emplace(result.filelist_display_order, result.failure);
+      continue;
+    }
+    for (const auto& fname : result.wget_filenames) {
+      wget_list.emplace_back(fname);
     }
-    replace_all(filename, ".tar", "");
-    if (data_format == "WMO_GRIB2") {
-      if (!regex_search(filename, regex(".grb2")) && !regex_search(filename,
-          regex(".grib2")))
-        filename += ".grb2";
+    fcount += result.fcount;
+    file_timing_data.emplace(result.filelist_display_order, std::move(result.
+        timing_data));
+    if (cancellation.is_cancelled()) {
+      break;
     }
-    thread_data[thread_index].file_code = file_code;
-    thread_data[thread_index].file_id = file_id;
-    thread_data[thread_index].data_format = data_format;
-    thread_data[thread_index].data_format_code = data_format_code;
-    thread_data[thread_index].filename = filename;
-    thread_data[thread_index].size_input = data_size;
-    thread_data[thread_index].filelist_display_order = filelist_display_order;
-    thread_data[thread_index].has_started = true;
-    thread_data[thread_index].has_finished = false;
-    thread_list[thread_index] = thread(build_file, ref(thread_data[
-        thread_index]), ref(is_temporal_subset));
-    size_input += data_size;
-    ++thread_index;
-    ++num_created_threads;
-    ++filelist_display_order;
   }
-  for (size_t n = 0; n < num_threads_to_create; ++n) {
-    if (thread_data[n].has_started) {
-      thread_list[n].join();
-      for (const auto& fname : thread_data[n].wget_filenames) {
-        wget_list.emplace_back(fname);
-      }
-      fcount += thread_data[n].fcount;
-      if (args.is_test || args.get_timings) {
-        timing_data.add(thread_data[n].timing_data);
-      }
-      if (args.is_test) {
-        write_bytes += thread_data[n].timing_data.read_bytes;
-      } else {
-        write_bytes += thread_data[n].write_bytes;
-      }
-      thread_data[n].timing_data.reset();
+
+  // on an early exit, drop any files that have not been started, and then let
+  //   the running workers finish before joining them
+  tasks.clear();
+  for (auto& worker : workers) {
+    worker.join();
+  }
+
+  // merge the timings in file order, so that the totals do not depend on the
+  //   order in which the files finished
+  if (args.is_test || args.get_timings) {
+    for (const auto& e : file_timing_data) {
+      timing_data.add(e.second);
     }
   }
-  if (!args.ignore_volume && write_bytes > 900000000000) {
-      terminate("Error: requested volume is too large", "Error: request volume "
-          "too large");
+  if (cancellation.is_cancelled()) {
+
+    // the workers have already removed the partial output of the files that
+    //   they stopped in
+    terminate(cancellation.stdout_msg(), cancellation.stderr_msg());
+  }
+  if (error != nullptr) {
+    std::rethrow_exception(error);
+  }
+
+  // register the files that are still buffered, before the request is
+  //   finished
+  registrar.flush();
+  if (!failed_files.empty()) {
+    if (failed_files.size() == input_files.size()) {
+      throw runtime_error("Error: all input files failed; first failure - " +
+          failed_files.begin()->second);
+    }
+    report_failed_files(failed_files);
+
+    // the request is finished with the files that were built, but the exit
+    //   status shows that it is incomplete
+    myerror = "Error: " + to_string(failed_files.size()) + " input file(s) "
+        "failed - see .failed_files";
   }
 }
 
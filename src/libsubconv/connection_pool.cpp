@@ -0,0 +1,60 @@
+#include <subconv.hpp>
+#include <PostgreSQL.hpp>
+
+using namespace PostgreSQL;
+using std::runtime_error;
+using std::unique_ptr;
+
+namespace subconv {
+
+ConnectionPool::~ConnectionPool() {
+  for (auto& server : idle) {
+    prepared_statements.forget(*server);
+    server->disconnect();
+  }
+}
+
+ConnectionPool::Lease ConnectionPool::get() {
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    cond.wait(lock, [this] { return !idle.empty() || num_open <
+        MAX_CONNECTIONS; });
+    if (!idle.empty()) {
+      unique_ptr<Server> server(std::move(idle.back()));
+      idle.pop_back();
+      return Lease(*this, std::move(server));
+    }
+    ++num_open;
+  }
+
+  // connect outside of the lock, so that other threads can return and reuse
+  //   connections in the meantime
+  unique_ptr<Server> server(new Server(CONFIG, TIMEOUT));
+  if (!*server) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      --num_open;
+    }
+    cond.notify_one();
+    throw runtime_error("ConnectionPool::get(): unable to connect to database "
+        "server: '" + server->error() + "'");
+  }
+  return Lease(*this, std::move(server));
+}
+
+void ConnectionPool::put(unique_ptr<Server> server) {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (*server) {
+      idle.emplace_back(std::move(server));
+    } else {
+
+      // a lost connection is dropped, and a new one is opened when needed
+      prepared_statements.forget(*server);
+      --num_open;
+    }
+  }
+  cond.notify_one();
+}
+
+} // end namespace subconv
@@ -65,9 +65,10 @@ void InputDataSource::read(off_t offset,size_t num_bytes)
   }
   if (args.get_timings) {
     timer->stop();
-    timing_data.read+=timer->elapsed_time();
-    timing_data.read_bytes+=num_bytes;
-    ++timing_data.num_reads;
+    timings.read+=timer->elapsed_time();
+    timings.read_bytes+=num_bytes;
+    ++timings.num_reads;
+    timings.read_latency.record(timer->elapsed_time());
   }
 }
 
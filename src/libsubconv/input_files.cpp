@@ -1,3 +1,5 @@
+#include <map>
+#include <tuple>
 #include <subconv.hpp>
 #include <PostgreSQL.hpp>
 #include <strutils.hpp>
@@ -22,6 +24,116 @@ using strutils::split;
 
 namespace subconv {
 
+namespace {
+
+// GridSpacing is what the spatial file selection needs from a grid definition:
+//   the latitude and longitude spacings to compare against those of the
+//   request
+struct GridSpacing {
+  GridSpacing() : ladiff(0.), lodiff(0.) { }
+  GridSpacing(float la, float lo) : ladiff(la), lodiff(lo) { }
+
+  float ladiff, lodiff;
+};
+
+// the parsed grid definitions, by code, and the Gaussian latitudes, by number
+//   of circles and direction, are loaded at most once in the process
+unordered_map<size_t, GridSpacing> grid_spacing_cache;
+std::map<pair<size_t, bool>, my::map<Grid::GLatEntry>> gaussian_latitudes_cache;
+
+float coordinate(string s, char negative_hemisphere) {
+  auto f = stof(s.substr(0, s.length() - 1));
+  if (s.back() == negative_hemisphere) {
+    f = -f;
+  }
+  return f;
+}
+
+my::map<Grid::GLatEntry>& gaussian_latitudes(size_t num_circles, bool
+    is_north_to_south) {
+  auto key = make_pair(num_circles, is_north_to_south);
+  auto it = gaussian_latitudes_cache.find(key);
+  if (it == gaussian_latitudes_cache.end()) {
+    it = gaussian_latitudes_cache.emplace(std::piecewise_construct, std::
+        forward_as_tuple(key), std::forward_as_tuple()).first;
+    gridutils::filled_gaussian_latitudes(args.SHARE_DIRECTORY + "/GRIB", it->
+        second, num_circles, is_north_to_south);
+  }
+  return it->second;
+}
+
+GridSpacing grid_spacing(string definition, string def_params) {
+  if (definition != "latLon" && definition != "gaussLatLon") {
+    terminate("Error: bad request\nYour request:\n" + args.rinfo, "Error: "
+        "grid_definition " + definition + " not understood");
+  }
+  auto sp = split(def_params, ":");
+  if (sp.size() < 8) {
+    terminate("Error: bad request\nYour request:\n" + args.rinfo, "Error: "
+        "def_params '" + def_params + "' for grid_definition " + definition +
+        " not understood");
+  }
+  Grid::GridDimensions grid_dim;
+  grid_dim.x = stoi(sp[0]);
+  grid_dim.y = stoi(sp[1]);
+  Grid::GridDefinition grid_def;
+  grid_def.slatitude = coordinate(sp[2], 'S');
+  grid_def.slongitude = coordinate(sp[3], 'W');
+  grid_def.elatitude = coordinate(sp[4], 'S');
+  grid_def.elongitude = coordinate(sp[5], 'W');
+  grid_def.loincrement = stof(sp[6]);
+  if (definition == "latLon") {
+    grid_def.laincrement = stof(sp[7]);
+    grid_def = gridutils::fix_grid_definition(grid_def, grid_dim);
+    return GridSpacing(grid_def.laincrement, grid_def.loincrement);
+  }
+  grid_def.num_circles = stoi(sp[7]);
+  grid_def = gridutils::fix_grid_definition(grid_def, grid_dim);
+  Grid::GLatEntry gle;
+  auto ladiff = request_values.ladiff * 2.;
+  if (gaussian_latitudes(grid_def.num_circles, grid_def.slatitude > grid_def.
+      elatitude).found(grid_def.num_circles, gle)) {
+    auto nlat_index = -1;
+    auto slat_index = -1;
+    for (size_t n = 0; n < grid_def.num_circles * 2; ++n) {
+      if (request_values.nlat <= gle.lats[n]) {
+        nlat_index = n;
+      }
+      if (request_values.slat <= gle.lats[n]) {
+        slat_index = n;
+      }
+    }
+    if (nlat_index > slat_index) {
+      ladiff = 0.;
+    }
+  }
+  return GridSpacing(ladiff, grid_def.loincrement);
+}
+
+// load_grid_spacings() adds any of the grid definitions that aren't already in
+//   the cache, with one query
+void load_grid_spacings(const unordered_set<size_t>& codes) {
+  string missing_codes;
+  for (const auto& code : codes) {
+    if (grid_spacing_cache.find(code) == grid_spacing_cache.end()) {
+      strutils::append(missing_codes, strutils::itos(code), ", ");
+    }
+  }
+  if (missing_codes.empty()) {
+    return;
+  }
+  LocalQuery q("code, definition, def_params", "WGrML.grid_definitions",
+      "code in (" + missing_codes + ")");
+  if (q.submit(metadata_server) < 0) {
+    terminate("Database error", "Error: " + q.error() + "\nQuery: " + q.show());
+  }
+  for (const auto& row : q) {
+    grid_spacing_cache.emplace(stoll(row[0]), grid_spacing(row[1], row[2]));
+  }
+}
+
+} // end unnamed namespace
+
 vector<InputFile> input_files(const QueryData& query_data) {
   vector<InputFile> input_files; // return value
   LocalQuery q;
@@ -61,153 +173,78 @@ vector<InputFile> input_files(const QueryData& query_data) {
         "Error: no files match the request\n" + args.rinfo);
   }
 
-// fill the RDA file map
+// fill the RDA file map, for only the files that matched the request, in
+//   batches of WFILE_BATCH_SIZE
+  const size_t WFILE_BATCH_SIZE = 1000;
   unordered_map<string, pair<long long, string>> rdafile_map;
-  q.set("wfile, data_size, tindex", "dssdb.wfile_" + metautils::args.dsid,
-      "type = 'D'");
+  vector<string> wfiles;
+  unordered_set<string> wfile_set;
+  for (const auto& row : input_files_query) {
+    if (wfile_set.emplace(row[1]).second) {
+      wfiles.emplace_back(row[1]);
+    }
+  }
   if (args.get_timings) {
     args.db_timer.start();
   }
-  if (q.submit(rdadb_server) < 0) {
-    terminate("Database error", "Error: " + q.error());
+  for (size_t n = 0; n < wfiles.size(); n += WFILE_BATCH_SIZE) {
+    string wfile_list;
+    auto end = std::min(n + WFILE_BATCH_SIZE, wfiles.size());
+    for (auto m = n; m < end; ++m) {
+      strutils::append(wfile_list, "'" + strutils::sql_ready(wfiles[m]) + "'",
+          ", ");
+    }
+    q.set("wfile, data_size, tindex", "dssdb.wfile_" + metautils::args.dsid,
+        "type = 'D' and wfile in (" + wfile_list + ")");
+    if (q.submit(rdadb_server) < 0) {
+      terminate("Database error", "Error: " + q.error());
+    }
+    for (const auto& r : q) {
+      rdafile_map.emplace(r[0], make_pair(stoll(r[1]), r[2]));
+    }
   }
   if (args.get_timings) {
     args.db_timer.stop();
     timing_data.db += args.db_timer.elapsed_time();
   }
-  for (const auto& r : q) {
-    rdafile_map.emplace(r[0], make_pair(stoll(r[1]), r[2]));
-  }
-
-  struct BitmapEntry {
-    struct Data {
-      Data() : ladiffs(), lodiffs() { }
-
-      vector<float> ladiffs, lodiffs;
-    };
-    BitmapEntry() : key(), data(nullptr) { }
 
-    string key;
-    shared_ptr<Data> data;
-  } bitmap_entry;
-  my::map<BitmapEntry> gridDefinition_bitmaps;
+  // decode each distinct grid definition bitmap once, and load all of the grid
+  //   definitions that they refer to with one query
+  auto is_spatial_selection = request_values.ladiff > 0.09 || fabs(
+      request_values.lodiff) > 0.09;
+  unordered_map<string, vector<GridSpacing>> bitmap_spacings;
+  if (is_spatial_selection) {
+    unordered_map<string, vector<size_t>> bitmap_codes;
+    unordered_set<size_t> codes;
+    for (const auto& row : input_files_query) {
+      if (bitmap_codes.find(row[3]) == bitmap_codes.end()) {
+        auto& values = bitmap_codes[row[3]];
+        bitmap::uncompress_values(row[3], values);
+        codes.insert(values.begin(), values.end());
+      }
+    }
+    load_grid_spacings(codes);
+    for (const auto& e : bitmap_codes) {
+      auto& spacings = bitmap_spacings[e.first];
+      for (const auto& code : e.second) {
+        auto it = grid_spacing_cache.find(code);
+        if (it != grid_spacing_cache.end()) {
+          spacings.emplace_back(it->second);
+        }
+      }
+    }
+  }
   unordered_set<string> input_files_set;
   for (const auto& row : input_files_query) {
     if (input_files_set.find(row[1]) == input_files_set.end() && format_map.
         find(row[2]) != format_map.end()) {
       auto format = format_map[row[2]];
       auto file_contains_spatial_selection = true;
-      if (request_values.ladiff > 0.09 || fabs(request_values.lodiff) > 0.09) {
-        if (!gridDefinition_bitmaps.found(row[3], bitmap_entry)) {
-          bitmap_entry.key = row[3];
-          bitmap_entry.data.reset(new BitmapEntry::Data);
-          gridDefinition_bitmaps.insert(bitmap_entry);
-          vector<size_t> gridDefinition_values;
-          bitmap::uncompress_values(row[3], gridDefinition_values);
-          for (const auto& gd_value : gridDefinition_values) {
-            LocalQuery grid_definition_query("definition, def_params", "WGrML."
-                "grid_definitions", "code = " + strutils::itos(gd_value));
-            if (grid_definition_query.submit(metadata_server) < 0) {
-                  terminate("Database error", "Error: " +
-                      grid_definition_query.error() + "\nQuery: " +
-                      grid_definition_query.show());
-            }
-            Row grid_definition_query_result;
-            if (grid_definition_query.fetch_row(grid_definition_query_result)) {
-              if (grid_definition_query_result[0] == "latLon") {
-                auto sp = split(grid_definition_query_result[1], ":");
-                Grid::GridDimensions grid_dim;
-                grid_dim.x = stoi(sp[0]);
-                grid_dim.y = stoi(sp[1]);
-                Grid::GridDefinition grid_def;
-                grid_def.slatitude=stof(sp[2].substr(0, sp[2].length() - 1));
-                if (sp[2].back() == 'S') {
-                  grid_def.slatitude =- grid_def.slatitude;
-                }
-                grid_def.slongitude = stof(sp[3].substr(0, sp[3].length() - 1));
-                if (sp[3].back() == 'W') {
-                  grid_def.slongitude =- grid_def.slongitude;
-                }
-                grid_def.elatitude = stof(sp[4].substr(0, sp[4].length() - 1));
-                if (sp[4].back() == 'S') {
-                  grid_def.elatitude =- grid_def.elatitude;
-                }
-                grid_def.elongitude = stof(sp[5].substr(0, sp[5].length() - 1));
-                if (sp[5].back() == 'W') {
-                  grid_def.elongitude =- grid_def.elongitude;
-                }
-                grid_def.loincrement = stof(sp[6]);
-                grid_def.laincrement = stof(sp[7]);
-                grid_def = gridutils::fix_grid_definition(grid_def, grid_dim);
-                bitmap_entry.data->ladiffs.emplace_back(grid_def.laincrement);
-                bitmap_entry.data->lodiffs.emplace_back(grid_def.loincrement);
-              } else if (grid_definition_query_result[0] == "gaussLatLon") {
-                auto sp = split(grid_definition_query_result[1], ":");
-                Grid::GridDimensions grid_dim;
-                grid_dim.x = stoi(sp[0]);
-                grid_dim.y = stoi(sp[1]);
-                Grid::GridDefinition grid_def;
-                grid_def.slatitude = stof(sp[2].substr(0, sp[2].length() - 1));
-                if (sp[2].back() == 'S') {
-                  grid_def.slatitude =- grid_def.slatitude;
-                }
-                grid_def.slongitude = stof(sp[3].substr(0, sp[3].length() - 1));
-                if (sp[3].back() == 'W') {
-                  grid_def.slongitude =- grid_def.slongitude;
-                }
-                grid_def.elatitude = stof(sp[4].substr(0, sp[4].length() - 1));
-                if (sp[4].back() == 'S') {
-                  grid_def.elatitude = -grid_def.elatitude;
-                }
-                grid_def.elongitude = stof(sp[5].substr(0, sp[5].length() - 1));
-                if (sp[5].back() == 'W') {
-                  grid_def.elongitude =- grid_def.elongitude;
-                }
-                grid_def.loincrement = stof(sp[6]);
-                grid_def.num_circles = stoi(sp[7]);
-                grid_def=gridutils::fix_grid_definition(grid_def, grid_dim);
-                my::map<Grid::GLatEntry> gaus_lats;
-                gridutils::filled_gaussian_latitudes(args.SHARE_DIRECTORY +
-                    "/GRIB", gaus_lats, grid_def.num_circles, (grid_def.
-                    slatitude > grid_def.elatitude));
-                Grid::GLatEntry gle;
-                if (gaus_lats.found(grid_def.num_circles, gle)) {
-                  auto nlat_index = -1;
-                  auto slat_index = -1;
-                  for (size_t n = 0; n < grid_def.num_circles*2; ++n) {
-                      if (request_values.nlat <= gle.lats[n]) {
-                        nlat_index = n;
-                      }
-                      if (request_values.slat <= gle.lats[n]) {
-                        slat_index = n;
-                      }
-                  }
-                  if (nlat_index > slat_index) {
-                    bitmap_entry.data->ladiffs.emplace_back(0.);
-                  } else {
-                    bitmap_entry.data->ladiffs.emplace_back(request_values.
-                        ladiff * 2.);
-                  }
-                } else {
-                  bitmap_entry.data->ladiffs.emplace_back(request_values.ladiff
-                      * 2.);
-                }
-                bitmap_entry.data->lodiffs.emplace_back(grid_def.loincrement);
-              } else {
-                terminate("Error: bad request\nYour request:\n" + args.rinfo,
-                    "Error: grid_definition " + grid_definition_query_result[0]
-                    + " not understood");
-              }
-            }
-          }
-        }
+      if (is_spatial_selection) {
         file_contains_spatial_selection = false;
-        auto it_lat = bitmap_entry.data->ladiffs.begin();
-        auto it_lon = bitmap_entry.data->lodiffs.begin();
-        auto end_it = bitmap_entry.data->ladiffs.end();
-        for (; it_lat != end_it; ++it_lat, ++it_lon) {
-          if ( (*it_lat - request_values.ladiff) < 0.0001 || (*it_lon - fabs(
-              request_values.lodiff)) < 0.0001) {
+        for (const auto& spacing : bitmap_spacings[row[3]]) {
+          if ( (spacing.ladiff - request_values.ladiff) < 0.0001 || (spacing.
+              lodiff - fabs(request_values.lodiff)) < 0.0001) {
             file_contains_spatial_selection = true;
           }
         }
@@ -0,0 +1,590 @@
+#include <algorithm>
+#include <map>
+#include <tuple>
+#include <subconv.hpp>
+#include <PostgreSQL.hpp>
+#include <strutils.hpp>
+#include <metadata.hpp>
+
+using namespace PostgreSQL;
+using std::get;
+using std::runtime_error;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+using strutils::append;
+using strutils::to_lower;
+
+namespace subconv {
+
+namespace {
+
+// the columns of an inventory query depend on the request and the data format
+//   of the file
+enum class InventoryShape {_DATED, _NETCDF, _PLAIN};
+
+InventoryShape inventory_shape(string data_format) {
+  if (request_values.ststep || request_values.topt_mo[0] || to_lower(
+      request_values.ofmt) == "csv") {
+    return InventoryShape::_DATED;
+  }
+  if (to_lower(data_format) == "netcdf" && request_values.ofmt.empty()) {
+    return InventoryShape::_NETCDF;
+  }
+  return InventoryShape::_PLAIN;
+}
+
+// the file codes of an inventory query are an array, which is the parameter $1
+//   of a prepared statement, or a literal for a query that is run only once
+string union_query(InventoryShape shape, string file_code_array, string
+    conditions) {
+  string columns = "byte_offset, byte_length";
+  if (shape != InventoryShape::_PLAIN) {
+    columns += ", valid_date";
+  }
+  if (shape == InventoryShape::_NETCDF) {
+    columns += ", process";
+  }
+  string union_query = "";
+  for (const auto& parameter : request_values.parameters) {
+    append(union_query, "select file_code, " + columns + " from \"IGrML\"." +
+        metautils::args.dsid + "_inventory_" + parameter_code(parameter) +
+        " where file_code = any(" + file_code_array + ")", " union ");
+    if (!conditions.empty()) {
+      union_query += " and " + conditions;
+    }
+  }
+  return union_query;
+}
+
+// byte_query() orders the rows of each file as they would be in a query for
+//   that file alone, and keeps the rows of a file together
+string byte_query(InventoryShape shape, string file_code_array, string
+    conditions) {
+  string order_by = "byte_offset";
+  if (shape == InventoryShape::_DATED) {
+    order_by = "valid_date, byte_offset";
+  } else if (shape == InventoryShape::_NETCDF) {
+    order_by = "valid_date";
+  }
+  return "select * from (" + union_query(shape, file_code_array, conditions)
+      + ") as u order by file_code, " + order_by;
+}
+
+bool is_selected_month(string valid_date) {
+  return !request_values.topt_mo[0] || request_values.topt_mo[stoi(valid_date.
+      substr(4, 2))];
+}
+
+// add_record() adds a row of a byte query to a list of records, unless the row
+//   falls in an unselected month; the queries already leave those rows out, so
+//   this is only a safeguard
+void add_record(InventoryShape shape, const Row& row, vector<ByteRecord>&
+    records) {
+  switch (shape) {
+    case InventoryShape::_DATED: {
+      if (is_selected_month(row[3])) {
+        records.emplace_back(stoll(row[1]), stoi(row[2]), row[3]);
+      }
+      break;
+    }
+    case InventoryShape::_NETCDF: {
+      records.emplace_back(stoll(row[1]), stoi(row[2]), row[3], row[4]);
+      break;
+    }
+    case InventoryShape::_PLAIN: {
+      records.emplace_back(stoll(row[1]), stoi(row[2]), "");
+      break;
+    }
+  }
+}
+
+// a file with more records than this is streamed by its worker through a
+//   cursor, instead of being held in memory
+const size_t MAX_HELD_RECORDS = 65536;
+
+long long to_ll(string s) {
+  return s.empty() ? 0 : stoll(s);
+}
+
+// fill_cache() copies the inventories of a parameter for the files that aren't
+//   in the inventory cache, with one query, and adds the rows that match the
+//   request to the rows of the files
+void fill_cache(Server& server, string parameter, int columns, const
+    std::unordered_map<string, size_t>& missing, vector<vector<
+    CachedInventoryRow>>& file_rows, bool apply_dates) {
+  vector<string> file_codes;
+  std::unordered_map<string, vector<CachedInventoryRow>> copies;
+  for (const auto& e : missing) {
+    file_codes.emplace_back(e.first);
+    copies.emplace(e.first, vector<CachedInventoryRow>());
+  }
+  string select = "select file_code, byte_offset, byte_length, valid_date, "
+      "level_code, time_range_code, grid_definition_code";
+  if ( (columns & InventoryCache::_INIT_DATE) != 0) {
+    select += ", init_date";
+  }
+  if ( (columns & InventoryCache::_PROCESS) != 0) {
+    select += ", process";
+  }
+  LocalQuery query(prepared_statements.execute(server, select + " from "
+      "\"IGrML\"." + metautils::args.dsid + "_inventory_" + parameter_code(
+      parameter) + " where file_code = any($1)", file_codes));
+  if (query.submit(server) < 0) {
+    throw runtime_error("fill_cache(): " + query.error() + " for query '" +
+        query.show() + "'");
+  }
+  for (const auto& row : query) {
+    CachedInventoryRow r;
+    r.byte_offset = stoll(row[1]);
+    r.byte_length = stoll(row[2]);
+    r.valid_date = stoll(row[3]);
+    r.level_code = stoi(row[4]);
+    r.time_range_code = stoi(row[5]);
+    r.grid_definition_code = stoi(row[6]);
+    size_t next = 7;
+    r.init_date = 0;
+    if ( (columns & InventoryCache::_INIT_DATE) != 0) {
+      r.init_date = to_ll(row[next++]);
+    }
+    r.process = InventoryCache::NO_PROCESS;
+    if ( (columns & InventoryCache::_PROCESS) != 0 && !row[next].empty()) {
+      r.process = stoi(row[next]);
+    }
+    copies[row[0]].emplace_back(r);
+  }
+  for (const auto& e : copies) {
+    inventory_cache.write(e.first, parameter_code(parameter), columns,
+        e.second);
+    auto& rows = file_rows[missing.at(e.first)];
+    for (const auto& r : e.second) {
+      if (inventory_cache.matches(r, apply_dates)) {
+        rows.emplace_back(r);
+      }
+    }
+  }
+}
+
+// cached_inventories() fills the inventories of files from the inventory
+//   cache, copying the inventories that aren't there yet; the rows of a file
+//   are combined and ordered as in a byte query
+void cached_inventories(Server& server, InventoryShape shape, const
+    vector<size_t>& indexes, const vector<InventoryFile>& files, bool
+    check_full_file, vector<FileInventory>& inventories) {
+  auto columns = request_values.dates_are_init ? InventoryCache::_INIT_DATE :
+      0;
+  if (shape == InventoryShape::_NETCDF) {
+    columns |= InventoryCache::_PROCESS;
+  }
+
+  // without the full-file check, only the rows that match the date conditions
+  //   are needed
+  auto apply_dates = !check_full_file;
+  vector<vector<CachedInventoryRow>> file_rows(files.size());
+  for (const auto& parameter : request_values.parameters) {
+    std::unordered_map<string, size_t> missing;
+    vector<CachedInventoryRow> copy;
+    for (const auto& idx : indexes) {
+      if (inventory_cache.read(files[idx].file_code, parameter_code(parameter),
+          columns, copy)) {
+        for (const auto& r : copy) {
+          if (inventory_cache.matches(r, apply_dates)) {
+            file_rows[idx].emplace_back(r);
+          }
+        }
+      } else {
+        missing.emplace(files[idx].file_code, idx);
+      }
+    }
+    if (!missing.empty()) {
+      fill_cache(server, parameter, columns, missing, file_rows, apply_dates);
+    }
+  }
+  auto key = [shape](const CachedInventoryRow& r) {
+    return std::make_tuple(shape == InventoryShape::_PLAIN ? 0 : r.valid_date,
+        r.byte_offset, r.byte_length, shape == InventoryShape::_NETCDF ? r.
+        process : 0);
+  };
+  for (const auto& idx : indexes) {
+    auto& rows = file_rows[idx];
+    std::sort(rows.begin(), rows.end(), [&key](const CachedInventoryRow& a,
+        const CachedInventoryRow& b) { return key(a) < key(b); });
+    rows.erase(std::unique(rows.begin(), rows.end(), [&key](const
+        CachedInventoryRow& a, const CachedInventoryRow& b) { return key(a) ==
+        key(b); }), rows.end());
+    auto& inventory = inventories[idx];
+    inventory.num_rows = std::count_if(rows.begin(), rows.end(), [](const
+        CachedInventoryRow& r) { return inventory_cache.matches(r, true); });
+    if (check_full_file) {
+      inventory.num_rows_no_dates = rows.size();
+      inventory.is_full_file = static_cast<long long>(inventory.num_rows) ==
+          inventory.num_rows_no_dates;
+    }
+    if (inventory.num_rows > MAX_HELD_RECORDS) {
+
+      // the cursor streams the records from the database
+      inventory.is_streamed = true;
+      continue;
+    }
+    for (const auto& r : rows) {
+      if (!inventory_cache.matches(r, true)) {
+        continue;
+      }
+      auto valid_date = std::to_string(r.valid_date);
+      switch (shape) {
+        case InventoryShape::_DATED: {
+          if (is_selected_month(valid_date)) {
+            inventory.records.emplace_back(r.byte_offset, r.byte_length,
+                valid_date);
+          }
+          break;
+        }
+        case InventoryShape::_NETCDF: {
+          inventory.records.emplace_back(r.byte_offset, r.byte_length,
+              valid_date, r.process == InventoryCache::NO_PROCESS ? "" : std::
+              to_string(r.process));
+          break;
+        }
+        case InventoryShape::_PLAIN: {
+          inventory.records.emplace_back(r.byte_offset, r.byte_length, "");
+          break;
+        }
+      }
+    }
+  }
+}
+
+// query_shape() runs the queries for files that have the same inventory shape
+//   - one for the record counts, one for the records of the files that aren't
+//   streamed, and, if needed, one for the full-file counts - and distributes
+//   the rows to the files; the inventory cache, if it is in use, replaces the
+//   queries
+void query_shape(Server& server, InventoryShape shape, const vector<size_t>&
+    indexes, const vector<InventoryFile>& files, string conditions, string
+    conditions_no_dates, vector<FileInventory>& inventories) {
+
+  // a netCDF file that needs no spatial subsetting can be linked as a full
+  //   file if none of its records were left out, so it also needs the count
+  //   without the date conditions
+  auto check_full_file = !args.is_test && shape == InventoryShape::_NETCDF &&
+      request_values.nlat > 99.;
+  if (inventory_cache.is_enabled()) {
+    try {
+      cached_inventories(server, shape, indexes, files, check_full_file,
+          inventories);
+      return;
+    } catch (runtime_error&) {
+
+      // the cache is optional, so the request goes on without it
+      inventory_cache.disable();
+      for (const auto& idx : indexes) {
+        inventories[idx] = FileInventory();
+      }
+    }
+  }
+  vector<string> file_codes;
+  std::unordered_map<string, size_t> index_map;
+  for (const auto& idx : indexes) {
+    file_codes.emplace_back(files[idx].file_code);
+    index_map.emplace(files[idx].file_code, idx);
+  }
+  LocalQuery count_query(prepared_statements.execute(server, "select "
+      "file_code, count(*) from (" + union_query(shape, "$1", conditions) + ") "
+      "as u group by file_code", file_codes));
+  if (count_query.submit(server) < 0) {
+    throw runtime_error("query_inventories(): " + count_query.error() +
+        " for query '" + count_query.show() + "'");
+  }
+  for (const auto& row : count_query) {
+    inventories[index_map.at(row[0])].num_rows = stoll(row[1]);
+  }
+  vector<string> held_file_codes;
+  for (const auto& idx : indexes) {
+    auto& inventory = inventories[idx];
+    if (inventory.num_rows > MAX_HELD_RECORDS) {
+      inventory.is_streamed = true;
+    } else if (inventory.num_rows > 0) {
+      held_file_codes.emplace_back(files[idx].file_code);
+    }
+  }
+  if (!held_file_codes.empty()) {
+    LocalQuery query(prepared_statements.execute(server, byte_query(shape,
+        "$1", conditions), held_file_codes));
+    if (query.submit(server) < 0) {
+      throw runtime_error("Error: " + query.error() + "\nQuery: " + query.
+          show());
+    }
+    for (const auto& row : query) {
+      add_record(shape, row, inventories[index_map.at(row[0])].records);
+    }
+  }
+  if (check_full_file) {
+    LocalQuery count_query_no_dates(prepared_statements.execute(server,
+        "select file_code, count(*) from (" + union_query(shape, "$1",
+        conditions_no_dates) + ") as u group by file_code", file_codes));
+    if (count_query_no_dates.submit(server) < 0) {
+      throw runtime_error("query_inventories(): " + count_query_no_dates.
+          error() + " for query '" + count_query_no_dates.show() + "'");
+    }
+    for (const auto& idx : indexes) {
+      inventories[idx].num_rows_no_dates = 0;
+    }
+    for (const auto& row : count_query_no_dates) {
+      inventories[index_map.at(row[0])].num_rows_no_dates = stoll(row[1]);
+    }
+    for (const auto& idx : indexes) {
+      auto& inventory = inventories[idx];
+      inventory.is_full_file = static_cast<long long>(inventory.num_rows) ==
+          inventory.num_rows_no_dates;
+    }
+  }
+}
+
+} // end unnamed namespace
+
+void query_inventories(Server& server, const vector<InventoryFile>& files,
+    string conditions, string conditions_no_dates, vector<FileInventory>&
+    inventories) {
+  inventories.clear();
+  inventories.resize(files.size());
+  std::map<InventoryShape, vector<size_t>> shape_map;
+  for (size_t n = 0; n < files.size(); ++n) {
+    shape_map[inventory_shape(files[n].data_format)].emplace_back(n);
+  }
+  for (const auto& e : shape_map) {
+    query_shape(server, e.first, e.second, files, conditions,
+        conditions_no_dates, inventories);
+  }
+}
+
+// has_temporal_subset() compares the number of records that the request selects
+//   from the input files with the number that it would select without the date
+//   conditions; one query counts both, for all of the files together - a
+//   selection of months is in both counts, so that it alone is not a temporal
+//   subset
+bool has_temporal_subset(Server& server, const vector<InputFile>& input_files,
+    string conditions, string conditions_no_dates) {
+  if (input_files.empty()) {
+    return false;
+  }
+  string file_codes;
+  for (const auto& input_file : input_files) {
+    append(file_codes, get<0>(input_file), ",");
+  }
+  auto months = month_condition();
+  string union_query, union_query_no_dates;
+  for (const auto& parameter : request_values.parameters) {
+    auto select = "select file_code, byte_offset from \"IGrML\"." + metautils::
+        args.dsid + "_inventory_" + parameter_code(parameter) + " where "
+        "file_code = any('{" + file_codes + "}')";
+    append(union_query, select + " and " + conditions, " union ");
+    append(union_query_no_dates, select, " union ");
+    if (!conditions_no_dates.empty()) {
+      union_query_no_dates += " and " + conditions_no_dates;
+    }
+    if (!months.empty()) {
+      union_query_no_dates += " and " + months;
+    }
+  }
+  LocalQuery query("select (select count(*) from (" + union_query + ") as u), "
+      "(select count(*) from (" + union_query_no_dates + ") as v)");
+  Row row;
+  if (query.submit(server) < 0 || !query.fetch_row(row)) {
+    throw runtime_error("has_temporal_subset(): " + query.error() + " for "
+        "query '" + query.show() + "'");
+  }
+  return stoll(row[0]) < stoll(row[1]);
+}
+
+InventoryCursor::InventoryCursor(const FileInventory& inventory,
+    ConnectionPool& metadb_pool, InventoryFile file, string conditions) :
+    inventory(inventory), metadb_pool(metadb_pool), INVENTORY_FILE(file),
+    CONDITIONS(conditions), server(nullptr), block(), num_rows_fetched(0),
+    is_started(false), is_done(false) { }
+
+InventoryCursor::~InventoryCursor() {
+  if (server != nullptr) {
+
+    // the cursor is closed with the transaction
+    (*server)->command("rollback");
+  }
+}
+
+bool InventoryCursor::next() {
+  if (is_done) {
+    return false;
+  }
+  if (!inventory.is_streamed) {
+
+    // the inventory holds all of the records, so they are one block
+    is_done = is_started;
+    is_started = true;
+    num_rows_fetched = inventory.num_rows;
+    return !is_done;
+  }
+  auto shape = inventory_shape(INVENTORY_FILE.data_format);
+  if (!is_started) {
+    server.reset(new ConnectionPool::Lease(metadb_pool.get()));
+
+    // a cursor can't be declared for a prepared statement, so the file code is
+    //   a literal
+    if ((*server)->command("begin") < 0 || (*server)->command("declare "
+        "inventory_cursor no scroll cursor for " + byte_query(shape, "'{" +
+        INVENTORY_FILE.file_code + "}'", CONDITIONS)) < 0) {
+      throw runtime_error("InventoryCursor::next(): unable to declare "
+          "cursor: '" + (*server)->error() + "'");
+    }
+    is_started = true;
+  }
+  LocalQuery query("fetch forward " + std::to_string(FETCH_SIZE) + " from "
+      "inventory_cursor");
+  if (query.submit(**server) < 0) {
+    throw runtime_error("InventoryCursor::next(): " + query.error() + " for "
+        "query '" + query.show() + "'");
+  }
+  if (query.num_rows() == 0) {
+    if ((*server)->command("close inventory_cursor") < 0 || (*server)->
+        command("commit") < 0) {
+      throw runtime_error("InventoryCursor::next(): unable to close cursor: '"
+          + (*server)->error() + "'");
+    }
+    server = nullptr;
+    is_done = true;
+    return false;
+  }
+  block.clear();
+  for (const auto& row : query) {
+    add_record(shape, row, block);
+  }
+  num_rows_fetched += query.num_rows();
+  return true;
+}
+
+double InventoryCursor::progress() const {
+  if (inventory.num_rows == 0) {
+    return 1.;
+  }
+  return std::min(static_cast<double>(num_rows_fetched) / inventory.num_rows,
+      1.);
+}
+
+InventoryPrefetcher::InventoryPrefetcher(const vector<FileTask>& tasks, size_t
+    depth, string conditions, string conditions_no_dates, ConnectionPool&
+    metadb_pool) : DEPTH(depth), CONDITIONS(conditions), CONDITIONS_NO_DATES(
+    conditions_no_dates), metadb_pool(metadb_pool), entries(tasks.size()),
+    index_map(), mutex(), cond(), num_taken(0), stopped(false),
+    prefetch_thread() {
+  for (size_t n = 0; n < tasks.size(); ++n) {
+    entries[n].file_code = get<0>(tasks[n].input_file);
+    entries[n].data_format = get<3>(tasks[n].input_file);
+    index_map.emplace(entries[n].file_code, n);
+  }
+  prefetch_thread = std::thread(&InventoryPrefetcher::run, this);
+}
+
+InventoryPrefetcher::~InventoryPrefetcher() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopped = true;
+  }
+  cond.notify_all();
+  prefetch_thread.join();
+}
+
+void InventoryPrefetcher::run() {
+  size_t next = 0;
+  while (next < entries.size()) {
+    vector<size_t> batch;
+    vector<InventoryFile> files;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+
+      // stay no more than DEPTH files ahead of the workers, and wait for at
+      //   least half of the window to open, so that the files are queried in
+      //   batches rather than one at a time
+      cond.wait(lock, [this, next] { return stopped || next + (DEPTH + 1) / 2
+          <= num_taken + DEPTH; });
+      if (stopped) {
+        break;
+      }
+      for (; next < entries.size() && next < num_taken + DEPTH; ++next) {
+        auto& entry = entries[next];
+        if (entry.state == State::_QUEUED) {
+          entry.state = State::_RUNNING;
+          batch.emplace_back(next);
+          files.emplace_back(entry.file_code, entry.data_format);
+        }
+      }
+    }
+    if (batch.empty()) {
+      continue;
+    }
+    vector<FileInventory> inventories;
+    try {
+      auto server = metadb_pool.get();
+      query_inventories(*server, files, CONDITIONS, CONDITIONS_NO_DATES,
+          inventories);
+    } catch (...) {
+
+      // let the workers run (and report on) the queries themselves
+      inventories.clear();
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      for (size_t n = 0; n < batch.size(); ++n) {
+        auto& entry = entries[batch[n]];
+        if (!inventories.empty()) {
+          entry.inventory.reset(new FileInventory(std::move(inventories[n])));
+        }
+        entry.state = State::_READY;
+      }
+    }
+    cond.notify_all();
+  }
+}
+
+unique_ptr<FileInventory> InventoryPrefetcher::take(string file_code) {
+  auto it = index_map.find(file_code);
+  if (it == index_map.end()) {
+    return nullptr;
+  }
+  auto& entry = entries[it->second];
+  std::unique_lock<std::mutex> lock(mutex);
+  if (!entry.is_taken) {
+    entry.is_taken = true;
+    ++num_taken;
+    cond.notify_all();
+  }
+  if (entry.state == State::_QUEUED || entry.state == State::_CLAIMED) {
+
+    // the prefetcher hasn't gotten to this file yet (so don't wait for it), or
+    //   its inventory has already been handed out
+    entry.state = State::_CLAIMED;
+    return nullptr;
+  }
+  cond.wait(lock, [&entry] { return entry.state == State::_READY; });
+  entry.state = State::_CLAIMED;
+  return std::move(entry.inventory);
+}
+
+void InventoryPrefetcher::skip(string file_code) {
+  auto it = index_map.find(file_code);
+  if (it == index_map.end()) {
+    return;
+  }
+  auto& entry = entries[it->second];
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!entry.is_taken) {
+      entry.is_taken = true;
+      ++num_taken;
+    }
+    if (entry.state == State::_QUEUED || entry.state == State::_READY) {
+      entry.state = State::_CLAIMED;
+      entry.inventory = nullptr;
+    }
+  }
+  cond.notify_all();
+}
+
+} // end namespace subconv
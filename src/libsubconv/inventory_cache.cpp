@@ -0,0 +1,145 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <subconv.hpp>
+
+using std::runtime_error;
+using std::string;
+using std::to_string;
+using std::vector;
+
+namespace subconv {
+
+namespace {
+
+// a copy is this header followed by the rows, as they are laid out in memory
+struct CacheHeader {
+  char magic[8];
+  char version[64];
+  int columns;
+  int reserved;
+  long long num_rows;
+};
+
+const char MAGIC[8] = "SCINV01";
+
+} // end unnamed namespace
+
+bool InventoryCache::matches(const CachedInventoryRow& row, bool apply_dates)
+    const {
+  if (apply_dates) {
+    auto date = filter.dates_are_init ? row.init_date : row.valid_date;
+    if ((filter.start_date > 0 && date < filter.start_date) || (filter.end_date
+        > 0 && date > filter.end_date)) {
+      return false;
+    }
+    if (!filter.months.empty() && filter.months.find(std::stoi(to_string(row.
+        valid_date).substr(4, 2))) == filter.months.end()) {
+      return false;
+    }
+  }
+  if (!filter.time_range_codes.empty() && filter.time_range_codes.find(row.
+      time_range_code) == filter.time_range_codes.end()) {
+    return false;
+  }
+  if (!filter.grid_definition_codes.empty() && filter.grid_definition_codes.
+      find(row.grid_definition_code) == filter.grid_definition_codes.end()) {
+    return false;
+  }
+  if (!filter.level_codes.empty() && (apply_dates || !filter.is_multi_level)
+      && filter.level_codes.find(row.level_code) == filter.level_codes.end()) {
+    return false;
+  }
+  return true;
+}
+
+void InventoryCache::open(string cache_directory, string dsid, const
+    InventoryFilter& inventory_filter) {
+  directory = cache_directory + "/" + dsid;
+  filter = inventory_filter;
+  enabled = false;
+  std::ifstream ifs((directory + "/.version").c_str());
+  if (!ifs.is_open()) {
+
+    // the dataset isn't cached
+    return;
+  }
+  std::getline(ifs, version);
+  version = version.substr(0, sizeof(CacheHeader::version) - 1);
+  enabled = !version.empty();
+}
+
+bool InventoryCache::read(string file_code, string parameter_code, int
+    columns, vector<CachedInventoryRow>& rows) const {
+  rows.clear();
+  auto fd = ::open((directory + "/" + parameter_code + "/" + file_code).c_str(),
+      O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  auto is_valid = false;
+  struct stat buf;
+  CacheHeader header;
+  if (fstat(fd, &buf) == 0 && buf.st_size >= static_cast<off_t>(sizeof(
+      CacheHeader)) && pread(fd, &header, sizeof(header), 0) ==
+      static_cast<ssize_t>(sizeof(header))) {
+
+    // the row count is checked against the file size by division, so that a
+    //   damaged count can't overflow
+    auto data_size = buf.st_size - static_cast<off_t>(sizeof(CacheHeader));
+    is_valid = memcmp(header.magic, MAGIC, sizeof(MAGIC)) == 0 && version ==
+        string(header.version, strnlen(header.version, sizeof(header.
+        version))) && (header.columns & columns) == columns && header.num_rows
+        >= 0 && data_size % sizeof(CachedInventoryRow) == 0 && header.num_rows
+        == static_cast<long long>(data_size / sizeof(CachedInventoryRow));
+    if (is_valid) {
+
+      // the rows are read straight into place
+      rows.resize(header.num_rows);
+      is_valid = pread(fd, rows.data(), data_size, sizeof(CacheHeader)) ==
+          data_size;
+      if (!is_valid) {
+        rows.clear();
+      }
+    }
+  }
+  close(fd);
+  return is_valid;
+}
+
+void InventoryCache::write(string file_code, string parameter_code, int
+    columns, const vector<CachedInventoryRow>& rows) const {
+  auto dirname = directory + "/" + parameter_code;
+  if (mkdir(dirname.c_str(), 0775) != 0 && errno != EEXIST) {
+    throw runtime_error("InventoryCache::write(): unable to create '" +
+        dirname + "'");
+  }
+  auto filename = dirname + "/" + file_code;
+
+  // every writer has its own temporary file, and the rename replaces the copy
+  //   in one step
+  auto temp_filename = filename + ".TMP." + to_string(getpid()) + "." +
+      to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+  auto header = CacheHeader();
+  memcpy(header.magic, MAGIC, sizeof(MAGIC));
+  version.copy(header.version, sizeof(header.version) - 1);
+  header.columns = columns;
+  header.num_rows = rows.size();
+  std::ofstream ofs(temp_filename.c_str(), std::ios::binary);
+  ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  ofs.write(reinterpret_cast<const char*>(rows.data()), rows.size() * sizeof(
+      CachedInventoryRow));
+  ofs.close();
+  if (!ofs || std::rename(temp_filename.c_str(), filename.c_str()) != 0) {
+    std::remove(temp_filename.c_str());
+    throw runtime_error("InventoryCache::write(): unable to write '" +
+        filename + "'");
+  }
+}
+
+} // end namespace subconv
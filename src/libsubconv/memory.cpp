@@ -0,0 +1,75 @@
+#include <fstream>
+#include <subconv.hpp>
+
+using std::ifstream;
+using std::string;
+
+namespace subconv {
+
+// cgroup_memory_limit() returns the memory limit of the cgroup, or 0 if there
+//   is no limit
+long long cgroup_memory_limit() {
+  long long limit = 0;
+
+  // cgroup v2: "<bytes>" or "max"
+  ifstream ifs("/sys/fs/cgroup/memory.max");
+  if (ifs.is_open()) {
+    string s;
+    ifs >> s;
+    if (s != "max") {
+      limit = std::stoll(s);
+    }
+  } else {
+
+    // cgroup v1: a huge number means no limit
+    ifs.open("/sys/fs/cgroup/memory/memory.limit_in_bytes");
+    if (ifs.is_open()) {
+      ifs >> limit;
+      if (limit >= (1LL << 60)) {
+        limit = 0;
+      }
+    }
+  }
+  return limit;
+}
+
+long long default_memory_limit(const Directives& directives) {
+  if (directives.memory_limit > 0) {
+    return directives.memory_limit;
+  }
+
+  // leave a quarter of the job's memory for everything that isn't a record or
+  //   I/O buffer
+  return cgroup_memory_limit() / 4 * 3;
+}
+
+long long MemoryGovernor::acquire(long long min_bytes, long long max_bytes) {
+  std::unique_lock<std::mutex> lock(mutex);
+  if (limit > 0) {
+    cond.wait(lock, [this, min_bytes] { return in_use == 0 || in_use +
+        min_bytes <= limit; });
+    max_bytes = std::max(min_bytes, std::min(max_bytes, limit - in_use));
+  }
+  in_use += max_bytes;
+  return max_bytes;
+}
+
+long long MemoryGovernor::demand() {
+  std::lock_guard<std::mutex> lock(mutex);
+  return max_demand;
+}
+
+void MemoryGovernor::note_demand(long long num_bytes) {
+  std::lock_guard<std::mutex> lock(mutex);
+  max_demand = std::max(max_demand, num_bytes);
+}
+
+void MemoryGovernor::release(long long num_bytes) {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    in_use -= num_bytes;
+  }
+  cond.notify_all();
+}
+
+} // end namespace subconv
@@ -16,28 +16,36 @@ using strutils::to_lower;
 
 namespace subconv {
 
+// multiple_parameter_files() returns the codes of the input files that have
+//   more than one combination of parameter, level, and time range in the
+//   request; all of the files are classified by one grouped query
 unordered_set<string> multiple_parameter_files(const vector<InputFile>&
     input_files, string inventory_conditions) {
   unordered_set<string> multiple_parameter_files_code_set; // return value
-  if (to_lower(request_values.ofmt) == "netcdf") {
+  if (to_lower(request_values.ofmt) == "netcdf" && !input_files.empty()) {
+    string file_codes;
     for (const auto& input_file : input_files) {
-      string union_query;
-      for (const auto& parameter : request_values.parameters) {
-        append(union_query, "select '" + parameter + "' as p, level_code, "
-            "time_range_code from \"IGrML\"." + request_values.metadata_dsid +
-            "_inventory_" + parameter_code(metadata_server, parameter) +
-            " where file_code = " + get<0>(input_file) + " and " +
-            inventory_conditions, " union ");
-      }
-      LocalQuery q("select distinct p, level_code, time_range_code from (" +
-          union_query + ") as u");
-      if (q.submit(metadata_server) < 0) {
-        terminate("Error: database error", "Error: " + q.error() + "\nQuery: " +
-            q.show());
-      }
-      if (q.num_rows() > 1) {
-        multiple_parameter_files_code_set.emplace(get<0>(input_file));
-      }
+      append(file_codes, get<0>(input_file), ",");
+    }
+    string union_query;
+    for (const auto& parameter : request_values.parameters) {
+      append(union_query, "select file_code, '" + parameter + "' as p, "
+          "level_code, time_range_code from \"IGrML\"." + request_values.
+          metadata_dsid + "_inventory_" + parameter_code(parameter) +
+          " where file_code = any('{" + file_codes + "}') and " +
+          inventory_conditions, " union ");
+    }
+
+    // the union has no duplicate rows, so each row of a file is a distinct
+    //   combination
+    LocalQuery q("select file_code from (" + union_query + ") as u group by "
+        "file_code having count(*) > 1");
+    if (q.submit(metadata_server) < 0) {
+      terminate("Error: database error", "Error: " + q.error() + "\nQuery: " +
+          q.show());
+    }
+    for (const auto& row : q) {
+      multiple_parameter_files_code_set.emplace(row[0]);
     }
   }
   return multiple_parameter_files_code_set;
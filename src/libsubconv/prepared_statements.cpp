@@ -0,0 +1,61 @@
+#include <algorithm>
+#include <cctype>
+#include <subconv.hpp>
+#include <PostgreSQL.hpp>
+#include <strutils.hpp>
+
+using namespace PostgreSQL;
+using std::runtime_error;
+using std::string;
+using std::vector;
+using strutils::append;
+
+namespace subconv {
+
+string PreparedStatements::execute(Server& server, string definition, const
+    vector<string>& file_codes) {
+
+  // the file codes are bound as one array literal, so anything other than
+  //   digits would change the statement
+  string array;
+  for (const auto& file_code : file_codes) {
+    if (file_code.empty() || !std::all_of(file_code.begin(), file_code.end(),
+        [](char c) { return std::isdigit(static_cast<unsigned char>(c)); })) {
+      throw runtime_error("PreparedStatements::execute(): bad file code '" +
+          file_code + "'");
+    }
+    append(array, file_code, ",");
+  }
+  string name;
+  bool is_prepared;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = names.find(definition);
+    if (it == names.end()) {
+      it = names.emplace(definition, "subconv_" + std::to_string(names.size())).
+          first;
+    }
+    name = it->second;
+    auto& connection_set = prepared[&server];
+    is_prepared = connection_set.find(name) != connection_set.end();
+  }
+  if (!is_prepared) {
+
+    // the connection belongs to the caller, so it can be prepared outside of
+    //   the lock
+    if (server.command("prepare " + name + " as " + definition) < 0) {
+      throw runtime_error("PreparedStatements::execute(): unable to prepare '" +
+          definition + "': '" + server.error() + "'");
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    prepared[&server].emplace(name);
+  }
+  return "execute " + name + "('{" + array + "}')";
+}
+
+void PreparedStatements::forget(const Server& server) {
+  std::lock_guard<std::mutex> lock(mutex);
+  prepared.erase(&server);
+}
+
+} // end namespace subconv
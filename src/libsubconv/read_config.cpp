@@ -34,6 +34,19 @@ Directives read_config() {
       } else if (lparts.front() == "objectStore") {
         directives.obj_store.fill(lparts[1], lparts[2], lparts[3], lparts[4],
             lparts[5]);
+      } else if (lparts.front() == "memoryLimit") {
+        auto l = lparts.back();
+        long long multiplier = 1;
+        auto idx = std::string("KMG").find(l.back());
+        if (idx != std::string::npos) {
+          multiplier <<= 10 * (idx + 1);
+          l.pop_back();
+        }
+        directives.memory_limit = std::stoll(l) * multiplier;
+      } else if (lparts.front() == "fileRetries") {
+        directives.file_retries = std::stoi(lparts.back());
+      } else if (lparts.front() == "inventoryCache") {
+        directives.inventory_cache = lparts.back();
       } else if (lparts.front() == "dataRoot") {
         directives.data_root = lparts.back();
       } else if (lparts.front() == "PostgreSQLServer") {
@@ -0,0 +1,66 @@
+#include <chrono>
+#include <subconv.hpp>
+#include <PostgreSQL.hpp>
+
+using namespace PostgreSQL;
+using std::string;
+
+namespace subconv {
+
+RequestWatcher::RequestWatcher(ConnectionPool& rdadb_pool) : rdadb_pool(
+    rdadb_pool), mutex(), cond(), stopped(false), watch_thread() {
+  if (!args.is_test && !args.rqst_index.empty()) {
+    watch_thread = std::thread(&RequestWatcher::run, this);
+  }
+}
+
+RequestWatcher::~RequestWatcher() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopped = true;
+  }
+  cond.notify_all();
+  if (watch_thread.joinable()) {
+    watch_thread.join();
+  }
+}
+
+void RequestWatcher::run() {
+  std::unique_lock<std::mutex> lock(mutex);
+  while (!cond.wait_for(lock, std::chrono::seconds(INTERVAL), [this] {
+      return stopped; })) {
+    lock.unlock();
+
+    // a failed connection or query is not a reason to cancel - try again at
+    //   the next check
+    string status;
+    auto is_missing = false;
+    try {
+      auto srv = rdadb_pool.get();
+      LocalQuery q("status", "dssdb.dsrqst", "rindex = " + args.rqst_index);
+      if (q.submit(*srv) == 0) {
+        Row row;
+        if (q.fetch_row(row)) {
+          status = row[0];
+        } else {
+          is_missing = true;
+        }
+      }
+    } catch (const std::runtime_error&) { }
+    if (is_missing) {
+      cancellation.cancel("Error: request " + args.rqst_index + " was "
+          "purged", "Error: request " + args.rqst_index + " no longer exists "
+          "in dsrqst");
+    } else if (status == "E" || status == "P") {
+      cancellation.cancel("Error: request " + args.rqst_index + " was "
+          "withdrawn", "Error: request " + args.rqst_index + " has status '" +
+          status + "' in dsrqst");
+    }
+    lock.lock();
+    if (cancellation.is_cancelled()) {
+      break;
+    }
+  }
+}
+
+} // end namespace subconv
@@ -0,0 +1,102 @@
+#include <algorithm>
+#include <functional>
+#include <numeric>
+#include <queue>
+#include <subconv.hpp>
+
+using std::get;
+using std::greater;
+using std::priority_queue;
+using std::vector;
+
+namespace subconv {
+
+long long estimated_cost(const InputFile& input_file) {
+
+  // the cost of a file is estimated from its size; the inventory row counts
+  //   aren't known until the file's byte query has been run
+  return std::max(get<2>(input_file), 1LL);
+}
+
+long long estimated_makespan(const vector<InputFile>& input_files, const
+    vector<size_t>& order, size_t num_threads) {
+
+  // simulate handing the files, in order, to whichever worker frees up first
+  priority_queue<long long, vector<long long>, greater<long long>> loads;
+  for (size_t n = 0; n < num_threads; ++n) {
+    loads.emplace(0);
+  }
+  long long makespan = 0;
+  for (const auto& idx : order) {
+    auto load = loads.top() + estimated_cost(input_files[idx]);
+    loads.pop();
+    loads.emplace(load);
+    makespan = std::max(makespan, load);
+  }
+  return makespan;
+}
+
+vector<size_t> schedule_input_files(const vector<InputFile>& input_files,
+    size_t num_threads) {
+  vector<size_t> order(input_files.size()); // return value
+  std::iota(order.begin(), order.end(), 0);
+  if (num_threads == 0) {
+    return order;
+  }
+  schedule_estimate.database_order = estimated_makespan(input_files, order,
+      num_threads);
+
+  // largest first, keeping database order for files of the same size
+  std::stable_sort(order.begin(), order.end(),
+      [&input_files](size_t left, size_t right) -> bool {
+        return estimated_cost(input_files[left]) > estimated_cost(input_files[
+            right]);
+      });
+  schedule_estimate.scheduled_order = estimated_makespan(input_files, order,
+      num_threads);
+  return order;
+}
+
+vector<size_t> shard_input_files(vector<InputFile>& input_files) {
+  vector<size_t> display_orders; // return value
+  if (args.num_shards == 0) {
+    for (size_t n = 0; n < input_files.size(); ++n) {
+      display_orders.emplace_back(n + 1);
+    }
+    return display_orders;
+  }
+
+  // deal the files out largest first, each to the shard with the least work so
+  //   far; this depends only on the file list, so every shard of the request
+  //   computes the same split
+  vector<size_t> order(input_files.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(),
+      [&input_files](size_t left, size_t right) -> bool {
+        return estimated_cost(input_files[left]) > estimated_cost(input_files[
+            right]);
+      });
+  vector<long long> loads(args.num_shards, 0);
+  vector<bool> is_in_shard(input_files.size(), false);
+  for (const auto& idx : order) {
+    auto shard = std::min_element(loads.begin(), loads.end()) - loads.begin();
+    loads[shard] += estimated_cost(input_files[idx]);
+    if (static_cast<size_t>(shard) == args.shard_index) {
+      is_in_shard[idx] = true;
+    }
+  }
+
+  // keep the shard's files in database order, along with their positions in
+  //   the full list
+  vector<InputFile> shard_files;
+  for (size_t n = 0; n < input_files.size(); ++n) {
+    if (is_in_shard[n]) {
+      shard_files.emplace_back(input_files[n]);
+      display_orders.emplace_back(n + 1);
+    }
+  }
+  input_files.swap(shard_files);
+  return display_orders;
+}
+
+} // end namespace subconv
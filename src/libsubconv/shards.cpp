@@ -0,0 +1,273 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <subconv.hpp>
+#include <PostgreSQL.hpp>
+#include <strutils.hpp>
+#include <utils.hpp>
+
+using std::cerr;
+using std::endl;
+using std::runtime_error;
+using std::string;
+using std::stringstream;
+using std::to_string;
+using std::vector;
+using strutils::append;
+
+namespace subconv {
+
+/* A shard manifest records the results of one shard of a request, for the
+**   merge run that finishes the request:
+**     size_input <bytes of input>
+**     fcount <number of files built>
+**     temporal <1 if the shard found temporal subsetting, otherwise 0>
+**     volume <bytes of output>
+**     errors <1 if the shard finished with errors, such as failed files,
+**       otherwise 0>
+**     file <download file name>    (one line per file)
+*/
+string shard_manifest_filename(size_t shard_index) {
+  return args.download_directory + "/.shard." + to_string(shard_index) + "." +
+      to_string(args.num_shards);
+}
+
+// the shards of a request each list their failed files separately, and the
+//   merge run combines the lists
+string shard_failed_files_filename(size_t shard_index) {
+  return args.download_directory + "/.failed_files." + to_string(shard_index) +
+      "." + to_string(args.num_shards);
+}
+
+string failed_files_filename() {
+  if (args.num_shards > 0 && !args.merge_shards) {
+    return shard_failed_files_filename(args.shard_index);
+  }
+  return args.download_directory + "/.failed_files";
+}
+
+// clear_shard_results() removes the results that an earlier attempt at this
+//   shard left behind, so that the merge run can't mistake them for results of
+//   this attempt
+void clear_shard_results() {
+  std::remove(shard_manifest_filename(args.shard_index).c_str());
+  std::remove(shard_failed_files_filename(args.shard_index).c_str());
+}
+
+void write_shard_manifest(const vector<string>& wget_list, long long
+    size_input, size_t fcount, bool is_temporal_subset, long long volume, bool
+    has_errors) {
+  auto filename = shard_manifest_filename(args.shard_index);
+
+  // write to a temporary file first, so that the merge run never sees a
+  //   partial manifest
+  std::ofstream ofs((filename + ".TMP").c_str());
+  if (!ofs.is_open()) {
+    throw runtime_error("write_shard_manifest(): unable to open '" + filename +
+        ".TMP' for output");
+  }
+  ofs << "size_input " << size_input << endl;
+  ofs << "fcount " << fcount << endl;
+  ofs << "temporal " << is_temporal_subset << endl;
+  ofs << "volume " << volume << endl;
+  ofs << "errors " << has_errors << endl;
+  for (const auto& fname : wget_list) {
+    ofs << "file " << fname << endl;
+  }
+  ofs.close();
+  if (!ofs || std::rename((filename + ".TMP").c_str(), filename.c_str()) !=
+      0) {
+    throw runtime_error("write_shard_manifest(): unable to write '" + filename +
+        "'");
+  }
+}
+
+// read_shard_manifests() combines the results of the shards; the request fails
+//   if any shard did not finish or finished with errors, or if the shards
+//   together went over the volume cap, which each shard only enforces for its
+//   own files
+void read_shard_manifests(vector<string>& wget_list, long long& size_input,
+    size_t& fcount, bool& is_temporal_subset) {
+  size_input = 0;
+  fcount = 0;
+  is_temporal_subset = false;
+  long long volume = 0;
+  vector<string> problems;
+  std::ofstream failed_ofs;
+  for (size_t n = 0; n < args.num_shards; ++n) {
+    auto shard = "shard " + to_string(n) + " of " + to_string(args.num_shards);
+    std::ifstream failed_ifs(shard_failed_files_filename(n).c_str());
+    if (failed_ifs.is_open()) {
+      if (!failed_ofs.is_open()) {
+        failed_ofs.open((args.download_directory + "/.failed_files").c_str());
+      }
+      failed_ofs << failed_ifs.rdbuf();
+    }
+    auto filename = shard_manifest_filename(n);
+    std::ifstream ifs(filename.c_str());
+    if (!ifs.is_open()) {
+      problems.emplace_back(shard + " did not finish - missing '" + filename +
+          "'");
+      continue;
+    }
+    string key;
+    while (ifs >> key) {
+      if (key == "size_input") {
+        long long l;
+        ifs >> l;
+        size_input += l;
+      } else if (key == "fcount") {
+        size_t i;
+        ifs >> i;
+        fcount += i;
+      } else if (key == "temporal") {
+        bool b;
+        ifs >> b;
+        is_temporal_subset = is_temporal_subset || b;
+      } else if (key == "volume") {
+        long long l;
+        ifs >> l;
+        volume += l;
+      } else if (key == "errors") {
+        bool b;
+        ifs >> b;
+        if (b) {
+          problems.emplace_back(shard + " finished with errors - see '" +
+              shard_failed_files_filename(n) + "' and the output of the "
+              "shard");
+        }
+      } else if (key == "file") {
+        string fname;
+        ifs >> fname;
+        wget_list.emplace_back(fname);
+      } else {
+        throw runtime_error("read_shard_manifests(): bad entry '" + key +
+            "' in '" + filename + "'");
+      }
+    }
+  }
+  long long merged_volume = 0;
+  volume_governor.update(merged_volume, volume);
+  if (cancellation.is_cancelled()) {
+    terminate(cancellation.stdout_msg(), cancellation.stderr_msg());
+  }
+  if (!problems.empty()) {
+    for (const auto& problem : problems) {
+      cerr << problem << endl;
+    }
+    throw runtime_error("read_shard_manifests(): " + to_string(problems.
+        size()) + " of " + to_string(args.num_shards) + " shard(s) did not "
+        "finish cleanly; first problem - " + problems.front());
+  }
+}
+
+// clear_stale_wfrqst_rows() removes the rows of the request in dssdb.wfrqst
+//   that are not for any of the files that the shards built, such as rows
+//   left by an earlier attempt at the request; the shards register their files
+//   concurrently, so only the merge run knows which rows are stale
+void clear_stale_wfrqst_rows(const vector<string>& wget_list) {
+  string array;
+  for (auto fname : wget_list) {
+    auto& compression = request_values.ancillary.compression;
+    if (!compression.empty() && fname.length() > compression.length() &&
+        fname.compare(fname.length() - compression.length(), string::npos,
+        compression) == 0) {
+      fname.erase(fname.length() - compression.length());
+    }
+
+    // each file name is a quoted element of one array literal
+    string element = "\"";
+    for (const auto& c : fname) {
+      if (c == '\\' || c == '"') {
+        element += '\\';
+      } else if (c == '\'') {
+        element += '\'';
+      }
+      element += c;
+    }
+    append(array, element + "\"", ",");
+  }
+  if (rdadb_server._delete("dssdb.wfrqst", "rindex = " + args.rqst_index +
+      " and wfile <> all('{" + array + "}')") < 0) {
+    throw runtime_error("clear_stale_wfrqst_rows(): unable to clear dssdb."
+        "wfrqst for request index " + args.rqst_index + ": '" + rdadb_server.
+        error() + "'");
+  }
+}
+
+// submit_merge_job() submits the run that finishes a request that is split
+//   into a job array, to start once every task of the array has ended; it
+//   starts even if some of them failed, so that it can report the failures
+//   - the merge run is submitted once for each array, so a requeued first
+//   task doesn't submit another one
+void submit_merge_job() {
+  const string MERGE_WALLTIME = "04:00:00";
+  char exe[4096];
+  auto len = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+  if (len < 0) {
+    throw runtime_error("submit_merge_job(): unable to find the path of the "
+        "executable");
+  }
+  exe[len] = '\0';
+  auto array_id = getenv("SLURM_ARRAY_JOB_ID") != nullptr ? getenv(
+      "SLURM_ARRAY_JOB_ID") : getenv("PBS_ARRAY_ID");
+  if (array_id == nullptr) {
+    throw runtime_error("submit_merge_job(): unable to find the id of the job "
+        "array");
+  }
+
+  // the marker is created before the submission, so that only one task can
+  //   ever submit
+  auto marker = args.download_directory + "/.merge_submitted." + array_id;
+  auto fd = open(marker.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0664);
+  if (fd < 0) {
+    if (errno == EEXIST) {
+      return;
+    }
+    throw runtime_error("submit_merge_job(): unable to create '" + marker +
+        "'");
+  }
+  close(fd);
+  auto merge_command = string(exe) + " --merge " + to_string(args.
+      num_shards) + " " + args.rqst_index + " " + args.download_directory;
+  string command;
+  if (getenv("SLURM_ARRAY_JOB_ID") != nullptr) {
+    command = "sbatch --dependency=afterany:" + string(array_id) +
+        " --job-name=subconv_merge --mem=4G -t " +
+        MERGE_WALLTIME;
+    if (getenv("SLURM_JOB_ACCOUNT") != nullptr) {
+      command += " --account=" + string(getenv("SLURM_JOB_ACCOUNT"));
+    }
+    if (getenv("SLURM_JOB_PARTITION") != nullptr) {
+      command += " --partition=" + string(getenv("SLURM_JOB_PARTITION"));
+    }
+    command += " --wrap \"" + merge_command + "\"";
+  } else {
+    command = "qsub -W depend=afterany:" + string(array_id) +
+        " -N subconv_merge -l select=1:ncpus=1:mem=4G,walltime=" +
+        MERGE_WALLTIME;
+    if (getenv("PBS_ACCOUNT") != nullptr) {
+      command += " -A " + string(getenv("PBS_ACCOUNT"));
+    }
+    if (getenv("PBS_QUEUE") != nullptr) {
+      command += " -q " + string(getenv("PBS_QUEUE"));
+    }
+    command += " -- " + merge_command;
+  }
+  stringstream oss, ess;
+  unixutils::mysystem2(command, oss, ess);
+  if (!ess.str().empty()) {
+
+    // let a requeued task try again
+    std::remove(marker.c_str());
+    throw runtime_error("submit_merge_job(): '" + command + "' failed: '" +
+        ess.str() + "'");
+  }
+}
+
+} // end namespace subconv
@@ -0,0 +1,83 @@
+#include <algorithm>
+#include <subconv.hpp>
+
+using std::function;
+using std::vector;
+
+namespace subconv {
+
+TaskPool::TaskPool(size_t num_threads) : batches(), mutex(), cond(),
+    stopped(false), threads() {
+  for (size_t n = 0; n < num_threads; ++n) {
+    threads.emplace_back(&TaskPool::work, this);
+  }
+}
+
+TaskPool::~TaskPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopped = true;
+  }
+  cond.notify_all();
+  for (auto& t : threads) {
+    t.join();
+  }
+}
+
+void TaskPool::run(const vector<function<void()>>& tasks) {
+  if (tasks.empty()) {
+    return;
+  }
+  Batch batch(tasks);
+  std::unique_lock<std::mutex> lock(mutex);
+  batches.emplace_back(&batch);
+  cond.notify_all();
+
+  // the lock is held until the first task has been taken, so that the calling
+  //   thread gets it
+  while (batch.next < tasks.size()) {
+    run_next(lock, batch);
+  }
+  cond.wait(lock, [&batch] { return batch.num_done == batch.tasks.size(); });
+  if (batch.error != nullptr) {
+    std::rethrow_exception(batch.error);
+  }
+}
+
+// run_next() runs the next task of a batch, without holding the lock while the
+//   task runs
+void TaskPool::run_next(std::unique_lock<std::mutex>& lock, Batch& batch) {
+  auto n = batch.next++;
+  if (batch.next == batch.tasks.size()) {
+
+    // all of the tasks of the batch have been taken
+    batches.erase(std::find(batches.begin(), batches.end(), &batch));
+  }
+  lock.unlock();
+  std::exception_ptr error = nullptr;
+  try {
+    batch.tasks[n]();
+  } catch (...) {
+    error = std::current_exception();
+  }
+  lock.lock();
+  if (error != nullptr && batch.error == nullptr) {
+    batch.error = error;
+  }
+  if (++batch.num_done == batch.tasks.size()) {
+    cond.notify_all();
+  }
+}
+
+void TaskPool::work() {
+  std::unique_lock<std::mutex> lock(mutex);
+  while (true) {
+    cond.wait(lock, [this] { return stopped || !batches.empty(); });
+    if (stopped) {
+      return;
+    }
+    run_next(lock, *batches.front());
+  }
+}
+
+} // end namespace subconv
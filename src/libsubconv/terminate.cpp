@@ -16,4 +16,19 @@ void terminate(string stdout_message, string stderr_message) {
   }
 }
 
+void throw_if_cancelled() {
+  if (cancellation.is_cancelled()) {
+    throw CancelledError();
+  }
+}
+
+void VolumeGovernor::update(long long& file_volume, long long new_volume) {
+  auto total = (volume += new_volume - file_volume);
+  file_volume = new_volume;
+  if (total > CAP && !args.ignore_volume) {
+    cancellation.cancel("Error: requested volume is too large", "Error: "
+        "request volume too large");
+  }
+}
+
 } // end namespace subconv
@@ -0,0 +1,91 @@
+#include <fstream>
+#include <sched.h>
+#include <subconv.hpp>
+
+using std::ifstream;
+using std::string;
+using std::vector;
+
+namespace subconv {
+
+const size_t MIN_THREADS = 2;
+const size_t MAX_THREADS = 32;
+
+// cgroup_cpu_limit() returns the number of CPUs allowed by the cgroup CPU
+//   quota, or 0 if there is no quota
+size_t cgroup_cpu_limit() {
+  long long quota = -1, period = 0;
+
+  // cgroup v2: "<quota> <period>" or "max <period>"
+  ifstream ifs("/sys/fs/cgroup/cpu.max");
+  if (ifs.is_open()) {
+    string s;
+    ifs >> s >> period;
+    if (s != "max") {
+      quota = std::stoll(s);
+    }
+  } else {
+
+    // cgroup v1
+    ifs.open("/sys/fs/cgroup/cpu/cpu.cfs_quota_us");
+    if (ifs.is_open()) {
+      ifs >> quota;
+      ifs.close();
+      ifs.clear();
+      ifs.open("/sys/fs/cgroup/cpu/cpu.cfs_period_us");
+      if (ifs.is_open()) {
+        ifs >> period;
+      }
+    }
+  }
+  if (quota <= 0 || period <= 0) {
+    return 0;
+  }
+  return std::max((quota + period - 1) / period, 1LL);
+}
+
+size_t available_cpus() {
+  size_t num_cpus = 0;
+  cpu_set_t cpu_set;
+  if (sched_getaffinity(0, sizeof(cpu_set), &cpu_set) == 0) {
+    num_cpus = CPU_COUNT(&cpu_set);
+  }
+  auto cgroup_cpus = cgroup_cpu_limit();
+  if (cgroup_cpus > 0 && (num_cpus == 0 || cgroup_cpus < num_cpus)) {
+    num_cpus = cgroup_cpus;
+  }
+  return num_cpus;
+}
+
+size_t default_num_threads(const vector<InputFile>& input_files) {
+
+  // relative cost of one file, by type of output:
+  //   native copy: mostly I/O, so more threads than this won't help
+  //   spatial subset: GRIB unpack/repack
+  //   netCDF/CSV conversion: unpack, plus conversion
+  size_t file_cost = 1, max_threads = 6;
+  if (!request_values.ofmt.empty()) {
+    file_cost = 8;
+    max_threads = MAX_THREADS;
+  } else if (request_values.nlat < 9999. && request_values.elon < 9999. &&
+      request_values.slat > -9999. && request_values.wlon > -9999.) {
+    file_cost = 4;
+    max_threads = MAX_THREADS;
+  }
+
+  // one thread per 10 units of work
+  auto num_threads = std::min(std::max((input_files.size() * file_cost + 9) /
+      10, MIN_THREADS), max_threads);
+
+  // a batch options run is asking for its allocation, so it isn't limited by
+  //   the CPUs on this host
+  if (args.batch_type == 0x0) {
+    auto num_cpus = available_cpus();
+    if (num_cpus > 0) {
+      num_threads = std::max(std::min(num_threads, num_cpus), MIN_THREADS);
+    }
+  }
+  return num_threads;
+}
+
+} // end namespace subconv
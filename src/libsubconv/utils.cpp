@@ -1,3 +1,5 @@
+#include <algorithm>
+#include <cmath>
 #include <subconv.hpp>
 #include <metadata.hpp>
 #include <PostgreSQL.hpp>
@@ -11,6 +13,7 @@ using std::cout;
 using std::endl;
 using std::runtime_error;
 using std::string;
+using strutils::append;
 using strutils::ftos;
 using strutils::itos;
 using strutils::lltos;
@@ -331,6 +334,55 @@ void update_rdadb(long long size_input, size_t fcount, string dsrqst_note,
   }
 }
 
+void LatencyHistogram::add(const LatencyHistogram& source) {
+  for (size_t n = 0; n < NUM_BUCKETS; ++n) {
+    counts[n] += source.counts[n];
+  }
+}
+
+size_t LatencyHistogram::count() const {
+  size_t total = 0;
+  for (const auto& c : counts) {
+    total += c;
+  }
+  return total;
+}
+
+double LatencyHistogram::percentile(double p) const {
+  auto total = count();
+  if (total == 0) {
+    return 0.;
+  }
+  auto target = std::max(static_cast<size_t>(ceil(p / 100. * total)),
+      static_cast<size_t>(1));
+  size_t cumulative = 0;
+  size_t n = 0;
+  for (; n < NUM_BUCKETS - 1; ++n) {
+    cumulative += counts[n];
+    if (cumulative >= target) {
+      break;
+    }
+  }
+  return 1.e-6 * pow(2., n / 4.);
+}
+
+void LatencyHistogram::record(double seconds) {
+  size_t n = 0;
+  if (seconds > 1.e-6) {
+    n = std::min(static_cast<size_t>(ceil(4. * log2(seconds / 1.e-6))),
+        NUM_BUCKETS - 1);
+  }
+  ++counts[n];
+}
+
+void print_latencies(string phase, const LatencyHistogram& histogram) {
+  if (histogram.count() > 0) {
+    cout << "  " << phase << " latency: p50 " << histogram.percentile(50.) *
+        1000. << " ms, p99 " << histogram.percentile(99.) * 1000. << " ms (" <<
+        histogram.count() << " samples)" << endl;
+  }
+}
+
 void print_timings() {
   cout.setf(std::ios::fixed);
   cout.precision(2);
@@ -345,12 +397,20 @@ void print_timings() {
       " seconds" << endl;
   cout << "Total database time: " << timing_data.db << " seconds" << endl;
   cout << "Total time in threads: " << timing_data.thread << " seconds" << endl;
+  if (schedule_estimate.database_order > 0) {
+    cout << "Estimated largest thread load: " << schedule_estimate.
+        scheduled_order / 1000000. << " MB (" << schedule_estimate.
+        database_order / 1000000. << " MB in database order, " << 100. - 100. *
+        schedule_estimate.scheduled_order / schedule_estimate.database_order <<
+        "% shorter tail)" << endl;
+  }
   cout << "Total read time: " << timing_data.read << " seconds" << endl;
   cout << "  Total bytes read: " << timing_data.read_bytes << " bytes" << endl;
   cout << "  Read rate: " << timing_data.read_bytes / 1000000. /
       timing_data.read << " MB/sec" << endl;
   cout << "  Average record length: " << static_cast<double>(
       timing_data.read_bytes) / timing_data.num_reads << " bytes" << endl;
+  print_latencies("Read", timing_data.read_latency);
   cout << "Total write time: " << timing_data.write << " seconds" << endl;
   cout << "Total GRIB2 uncompress time: " << timing_data.grib2u << " seconds" <<
       endl;
@@ -358,16 +418,39 @@ void print_timings() {
       endl;
   cout << "Total netCDF conversion time: " << timing_data.nc << " seconds" <<
       endl;
+  print_latencies("Record decode/subset", timing_data.decode_latency);
 }
 
-string parameter_code(Server& server, string parameter) {
-  LocalQuery q("code", "IGrML.parameters", "parameter = '" + parameter + "'");
-  Row r;
-  if (q.submit(server) < 0 || !q.fetch_row(r)) {
+// the IGrML parameter codes of the requested parameters; filled once, before
+//   any worker threads start, and only read after that
+std::unordered_map<string, string> parameter_code_table;
+
+void load_parameter_codes(Server& server) {
+  string parameters;
+  for (const auto& parameter : request_values.parameters) {
+    append(parameters, "'" + sql_ready(parameter) + "'", ", ");
+  }
+  if (parameters.empty()) {
+    return;
+  }
+  LocalQuery q("parameter, code", "IGrML.parameters", "parameter in (" +
+      parameters + ")");
+  if (q.submit(server) < 0) {
     terminate("Error: database error", "Error: " + q.error() + "\nQuery: " + q.
         show());
   }
-  return r[0];
+  for (const auto& r : q) {
+    parameter_code_table.emplace(r[0], r[1]);
+  }
+}
+
+string parameter_code(string parameter) {
+  auto it = parameter_code_table.find(parameter);
+  if (it == parameter_code_table.end()) {
+    terminate("Error: database error", "Error: no code in IGrML.parameters for "
+        "parameter '" + parameter + "'");
+  }
+  return it->second;
 }
 
 } // end namespace subconv
@@ -0,0 +1,70 @@
+#include <subconv.hpp>
+#include <PostgreSQL.hpp>
+#include <strutils.hpp>
+
+using std::runtime_error;
+using std::string;
+using std::unordered_map;
+using strutils::append;
+using strutils::itos;
+
+namespace subconv {
+
+void WfrqstRegistrar::add(string filename, string data_format, size_t
+    filelist_display_order) {
+  size_t num_buffered;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    buffer[filename] = Registration(data_format, filelist_display_order);
+    num_buffered = buffer.size();
+  }
+  if (num_buffered >= FLUSH_SIZE) {
+    flush();
+  }
+}
+
+void WfrqstRegistrar::flush() {
+  unordered_map<string, Registration> registrations;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    registrations.swap(buffer);
+  }
+  if (registrations.empty()) {
+    return;
+  }
+  string values;
+  for (const auto& e : registrations) {
+    append(values, "(" + REQUEST_INDEX + ", " + itos(e.second.
+        filelist_display_order) + ", '" + e.second.data_format + "', '', '" +
+        e.first + "', 'O')", ", ");
+  }
+
+  // one statement, so that the batch is registered all or nothing
+  string error;
+  try {
+    auto server = rdadb_pool.get();
+    if (server->command("insert into dssdb.wfrqst (rindex, disp_order, "
+        "data_format, file_format, wfile, status) values " + values + " on "
+        "conflict (rindex, wfile) do update set disp_order = excluded."
+        "disp_order, data_format = excluded.data_format") < 0) {
+      error = server->error();
+    }
+  } catch (const runtime_error& e) {
+    error = e.what();
+  }
+  if (!error.empty()) {
+
+    // put the registrations back for the next flush, without overwriting any
+    //   that were made for the same files in the meantime
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      for (auto& e : registrations) {
+        buffer.emplace(e.first, std::move(e.second));
+      }
+    }
+    throw runtime_error("WfrqstRegistrar::flush(): unable to register " +
+        itos(registrations.size()) + " file(s): " + error);
+  }
+}
+
+} // end namespace subconv
@@ -7,7 +7,6 @@
 */
 #include "../include/subconv.hpp"
 #include <iostream>
-#include <thread>
 #include <PostgreSQL.hpp>
 #include <utils.hpp>
 #include <metadata.hpp>
@@ -32,6 +31,12 @@ string myoutput = "";
 subconv::Args subconv::args;
 subconv::RequestValues subconv::request_values;
 subconv::TimingData subconv::timing_data;
+subconv::ScheduleEstimate subconv::schedule_estimate;
+subconv::Cancellation subconv::cancellation;
+subconv::VolumeGovernor subconv::volume_governor;
+subconv::MemoryGovernor subconv::memory_governor;
+subconv::InventoryCache subconv::inventory_cache;
+subconv::PreparedStatements subconv::prepared_statements;
 Server subconv::metadata_server;
 Server subconv::rdadb_server;
 char subconv::locflag;
@@ -51,6 +56,16 @@ int main(int argc, char **argv) {
     // set the exit function
     atexit(subconv::clean_up);
 
+    // the first task of a job array submits the run that finishes the request
+    //   after the array, before it does anything that could fail; a requeued
+    //   first task finds that the run was already submitted
+    if (subconv::args.is_array_task && subconv::args.shard_index == 0) {
+      subconv::submit_merge_job();
+    }
+    if (subconv::args.num_shards > 0 && !subconv::args.merge_shards) {
+      subconv::clear_shard_results();
+    }
+
     // connect to the database servers
     subconv::metadata_server.connect(metautils::directives.metadb_config);
     if (!subconv::metadata_server) {
@@ -68,6 +83,8 @@ int main(int argc, char **argv) {
 
     // read the configuration for subconv
     auto subconv_directives = subconv::read_config();
+    subconv::memory_governor.set_limit(subconv::default_memory_limit(
+        subconv_directives));
     if (subconv::args.batch_type != 0x0 && !subconv_directives.pbs_options.
         empty()) {
       cout << "-l " << subconv_directives.pbs_options << endl;
@@ -140,124 +157,172 @@ int main(int argc, char **argv) {
       }
     }
 
-    // build the query constructs that will be used for the DB queries required
-    //   to fulfill the request
-    subconv::QueryData query_data;
-    subconv::build_query_constructs(query_data);
+    vector<string> wget_list;
+    long long size_input = 0;
+    size_t fcount = 0;
+    bool is_temporal_subset = false;
+    if (subconv::args.merge_shards) {
+
+      // a merge run finishes a request from the results of its shards, which
+      //   have already built the subset files
+      subconv::read_shard_manifests(wget_list, size_input, fcount,
+          is_temporal_subset);
+      subconv::clear_stale_wfrqst_rows(wget_list);
+      subconv::metadata_server.disconnect();
+      subconv::rdadb_server.disconnect();
+    } else {
+
+      // look up the inventory codes of the requested parameters, once for the
+      //   whole run
+      subconv::load_parameter_codes(subconv::metadata_server);
+
+      // build the query constructs that will be used for the DB queries
+      //   required to fulfill the request
+      subconv::QueryData query_data;
+      subconv::build_query_constructs(query_data);
+      if (!subconv_directives.inventory_cache.empty()) {
+        subconv::inventory_cache.open(subconv_directives.inventory_cache,
+            metautils::args.dsid, query_data.filter);
+      }
 
-    // get the list of input files
-    auto input_files = subconv::input_files(query_data);
+      // get the list of input files
+      auto input_files = subconv::input_files(query_data);
 
-    // if the input file list is empty, then no data match the request
-    if (input_files.empty()) {
-      subconv::terminate("Error: no data match the request\nYour request: \n" +
-          subconv::args.rinfo, "Error: no data match the request\n " +
-          subconv::args.rinfo);
-    }
+      // if the input file list is empty, then no data match the request
+      if (input_files.empty()) {
+        subconv::terminate("Error: no data match the request\nYour request: "
+            "\n" + subconv::args.rinfo, "Error: no data match the request\n " +
+            subconv::args.rinfo);
+      }
 
-    // set the email notice template and initialize fcount
-    if (!subconv::args.is_test) {
-      subconv::rdadb_server.update("dssdb.dsrqst", "enotice = '" + subconv::
-          args.download_directory + "/.email_notice', fcount = " + to_string(
-          input_files.size()), "rindex = " + subconv::args.rqst_index);
-    }
+      // set the email notice template and initialize fcount
+      if (!subconv::args.is_test) {
+        subconv::rdadb_server.update("dssdb.dsrqst", "enotice = '" + subconv::
+            args.download_directory + "/.email_notice', fcount = " + to_string(
+            input_files.size()), "rindex = " + subconv::args.rqst_index);
+      }
 
-    // if the number of threads was not specified at startup, compute the
-    //   number, with a maximum of 6 and a minimum of 2
-    if (subconv::args.num_threads == 0) {
-      subconv::args.num_threads = std::min(std::max(static_cast<int>((
-          input_files.size() + 9) / 10), 2), 6);
-    }
+      // a shard builds only its slice of the input files; the files keep their
+      //   display order from the full list
+      auto display_orders = subconv::shard_input_files(input_files);
+      if (input_files.empty()) {
+        subconv::write_shard_manifest(vector<string>(), 0, 0, false, 0, false);
+        return 0;
+      }
 
-    // if this is a sbatch options run and there are a large number of input
-    //   files, then set num_reads to a very large number, compute the dynamic
-    //   sbatch options from that, and exit
-    if (subconv::args.batch_type != 0x0 && input_files.size() > 1000) {
-      subconv::timing_data.num_reads = 0x40000000 | input_files.size();
-      cout << subconv::batch_options(subconv_directives) << endl;
-      return 0;
-    }
+      // if the number of threads was not specified at startup, compute the
+      //   number from the cost of the request and the CPUs available to the job
+      if (subconv::args.num_threads == 0) {
+        subconv::args.num_threads = subconv::default_num_threads(input_files);
+      }
 
-    // identify files that have multiple parameters in them
-    auto multiple_parameter_files_code_set = subconv::multiple_parameter_files(
-        input_files, query_data.conditions.inventory);
+      // if this is a sbatch options run and there are a large number of input
+      //   files, then set num_reads to a very large number, compute the dynamic
+      //   sbatch options from that, and exit
+      if (subconv::args.batch_type != 0x0 && input_files.size() > 1000) {
+        subconv::timing_data.num_reads = 0x40000000 | input_files.size();
+        cout << subconv::batch_options(subconv_directives) << endl;
+        return 0;
+      }
+
+      // identify files that have multiple parameters in them
+      auto multiple_parameter_files_code_set = subconv::
+          multiple_parameter_files(input_files, query_data.conditions.
+          inventory);
 
 /*
 // done with RDA files hash, so clear it
   rdafile_map.clear();
 */
 
-    // clear dssdb.wfrqst
-    if (subconv::args.batch_type == 0x0) {
-      subconv::rdadb_server._delete("dssdb.wfrqst", "rindex = " + subconv::args.
-          rqst_index);
-    }
+      // clear dssdb.wfrqst; the shards of a request share its rows, so they
+      //   leave them alone, and the merge run clears the stale ones instead
+      if (subconv::args.batch_type == 0x0 && subconv::args.num_shards == 0) {
+        subconv::rdadb_server._delete("dssdb.wfrqst", "rindex = " + subconv::
+            args.rqst_index);
+      }
 
-    // get the location flag for the input files
-    LocalQuery locflag_query("locflag", "dssdb.dataset", "dsid = '" +
-        metautils::args.dsid + "'");
-    if (locflag_query.submit(subconv::rdadb_server) < 0) {
-      throw my::BadOperation_Error("unable to get input files location flag: '"
-          + locflag_query.error() + "'");
-    }
-    Row locflag_row;
-    if (!locflag_query.fetch_row(locflag_row)) {
-      throw my::BadOperation_Error("error reading location flag result: '" + 
-          locflag_query.error() + "'");
-      return 1;
-    }
-    subconv::locflag = locflag_row[0].front();
+      // get the location flag for the input files
+      LocalQuery locflag_query("locflag", "dssdb.dataset", "dsid = '" +
+          metautils::args.dsid + "'");
+      if (locflag_query.submit(subconv::rdadb_server) < 0) {
+        throw my::BadOperation_Error("unable to get input files location "
+            "flag: '" + locflag_query.error() + "'");
+      }
+      Row locflag_row;
+      if (!locflag_query.fetch_row(locflag_row)) {
+        throw my::BadOperation_Error("error reading location flag result: '" + 
+            locflag_query.error() + "'");
+        return 1;
+      }
+      subconv::locflag = locflag_row[0].front();
 
-    // done with the database servers, so disconnect
-    subconv::metadata_server.disconnect();
-    subconv::rdadb_server.disconnect();
+      // done with the database servers, so disconnect
+      subconv::metadata_server.disconnect();
+      subconv::rdadb_server.disconnect();
 
-    // initialize the data for each thread
-    subconv::ThreadData thread_data[subconv::args.num_threads];
-    if (subconv::args.get_timings) {
-      subconv::args.db_timer.start();
-    }
-    auto webhome = metautils::directives.data_root + "/" + metautils::args.dsid;
-    if (subconv::args.get_timings) {
-      subconv::args.db_timer.stop();
-      subconv::timing_data.db += subconv::args.db_timer.elapsed_time();
-    }
-    for (size_t n = 0; n < subconv::args.num_threads; ++n) {
-      thread_data[n].webhome = webhome;
-      thread_data[n].include_parameter_codes_set = include_parameter_codes_set;
-      thread_data[n].uConditions = query_data.conditions.union_;
-      thread_data[n].uConditions_no_dates = query_data.conditions.
-          union_non_date;
-      thread_data[n].multi_set = make_shared<unordered_set<string>>(
-          multiple_parameter_files_code_set);
-      thread_data[n].parameter_mapper.reset(new xmlutils::ParameterMapper(
-          subconv::args.SHARE_DIRECTORY + "/metadata/ParameterTables"));
-      if (subconv::locflag == 'O') {
-        thread_data[n].s3_session.reset(new s3::Session(subconv_directives.
-            obj_store.host, subconv_directives.obj_store.access_key,
-            subconv_directives.obj_store.secret_key, subconv_directives.
-            obj_store.region, subconv_directives.obj_store.terminal));
+      // initialize the data for each thread
+      subconv::ThreadData thread_data[subconv::args.num_threads];
+      if (subconv::args.get_timings) {
+        subconv::args.db_timer.start();
+      }
+      auto webhome = metautils::directives.data_root + "/" + metautils::args.
+          dsid;
+      if (subconv::args.get_timings) {
+        subconv::args.db_timer.stop();
+        subconv::timing_data.db += subconv::args.db_timer.elapsed_time();
+      }
+      for (size_t n = 0; n < subconv::args.num_threads; ++n) {
+        thread_data[n].webhome = webhome;
+        thread_data[n].include_parameter_codes_set =
+            include_parameter_codes_set;
+        thread_data[n].uConditions = query_data.conditions.union_;
+        thread_data[n].uConditions_no_dates = query_data.conditions.
+            union_non_date;
+        thread_data[n].multi_set = make_shared<unordered_set<string>>(
+            multiple_parameter_files_code_set);
+        thread_data[n].file_retries = subconv_directives.file_retries;
+        thread_data[n].parameter_mapper.reset(new xmlutils::ParameterMapper(
+            subconv::args.SHARE_DIRECTORY + "/metadata/ParameterTables"));
+        if (subconv::locflag == 'O') {
+          thread_data[n].obj_store = subconv_directives.obj_store;
+          thread_data[n].s3_session.reset(new s3::Session(subconv_directives.
+              obj_store.host, subconv_directives.obj_store.access_key,
+              subconv_directives.obj_store.secret_key, subconv_directives.
+              obj_store.region, subconv_directives.obj_store.terminal));
+        }
       }
-    }
-    std::thread thread_list[subconv::args.num_threads];
 
-    // build the subset files
-    vector<string> wget_list;
-    long long size_input;
-    size_t fcount = 0;
-    bool is_temporal_subset = false;
-    subconv::build_subset_files(input_files, multiple_parameter_files_code_set,
-        thread_data, wget_list, size_input, fcount, is_temporal_subset);
+      // build the subset files
+      subconv::build_subset_files(input_files, display_orders, thread_data,
+          wget_list, size_input, fcount, is_temporal_subset);
 
-    // deallocate memory
-    for (size_t n = 0; n < subconv::args.num_threads; ++n) {
-      thread_data[n].obuffer = nullptr;
-    }
+      // deallocate memory
+      for (size_t n = 0; n < subconv::args.num_threads; ++n) {
+        thread_data[n].obuffer = nullptr;
+      }
 
-    // if the was a test run (not for sbatch info), then we are done
-    if (subconv::args.is_test && subconv::args.batch_type == 0x0) {
-      cout << "Success: " << subconv::timing_data.num_reads << " grids" << endl;
-      return 0;
+      // if the was a test run (not for sbatch info), then we are done
+      if (subconv::args.is_test && subconv::args.batch_type == 0x0) {
+        cout << "Success: " << subconv::timing_data.num_reads << " grids" <<
+            endl;
+        return 0;
+      }
+
+      // a shard leaves its results for the merge run, which finishes the
+      //   request
+      if (subconv::args.num_shards > 0 && subconv::args.batch_type == 0x0) {
+        subconv::write_shard_manifest(wget_list, size_input, fcount,
+            is_temporal_subset, subconv::volume_governor.total(), !myerror.
+            empty());
+        if (subconv::args.get_timings) {
+          subconv::print_timings();
+        }
+        if (!myerror.empty()) {
+          return 1;
+        }
+        return 0;
+      }
     }
 
     // re-connect to the database servers